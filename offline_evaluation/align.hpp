@@ -0,0 +1,200 @@
+// Copyright 2020, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Yi-Chun Lin <circle40191@gmail.com>
+
+#pragma once
+
+#include <functional>
+#include "utils.hpp"
+
+/*
+ * Alignment of algorithm and truth sentences that were tokenized differently.
+ *
+ * The surface forms of both token sequences are hashed and matched with
+ * Myers' O(ND) diff, where D is the number of inserted and deleted tokens.
+ * The labels of the algorithm tokens are then projected onto the truth
+ * positions, so the sentence can be scored like an aligned one.
+ */
+
+const size_t MAX_ALIGN_EDITS = 64;
+
+inline uint64_t surfaceHash(const string& word) {
+  return std::hash<string>()(word.substr(0, word.find('\\')));
+}
+
+// The IOB field of a word, i.e. an entity id, "I" or "O".
+inline string getLabel(const string& word) {
+  std::size_t pos = word.find('\\');
+  pos = pos == string::npos ? pos : word.find('\\', pos + 1);
+  if (pos == string::npos) {
+    return "O";
+  }
+  return word.substr(pos + 1, word.find('\\', pos + 1) - pos - 1);
+}
+
+inline bool isEntityStart(const string& label) {
+  return label != "I" && label != "O";
+}
+
+/*
+ * Append the matched index pairs of a longest common subsequence of a and b
+ * to matches. Return false if a and b differ in more than maxEdits
+ * insertions and deletions.
+ */
+inline bool myersDiff(const vector<uint64_t>& a, const vector<uint64_t>& b,
+    const size_t maxEdits, vector<std::pair<size_t, size_t>>& matches) {
+  int n = a.size();
+  int m = b.size();
+  int maxD = std::min(static_cast<int>(maxEdits), n + m);
+  int offset = maxD + 1;
+  vector<int> v(2 * maxD + 3, 0);
+  vector<vector<int>> trace;
+
+  for (int d = 0; d <= maxD; d++) {
+    for (int k = -d; k <= d; k += 2) {
+      int x = (k == -d || (k != d && v[offset + k - 1] < v[offset + k + 1])) ?
+        v[offset + k + 1] : v[offset + k - 1] + 1;
+      int y = x - k;
+      while (x < n && y < m && a[x] == b[y]) {
+        x++;
+        y++;
+      }
+      v[offset + k] = x;
+
+      if (x < n || y < m) {
+        continue;
+      }
+
+      // Walk back through the furthest reaching paths of each d.
+      size_t first = matches.size();
+      for (int e = d; e > 0; e--) {
+        const vector<int>& prev = trace[e - 1];
+        int kk = x - y;
+        int prevK = (kk == -e || (kk != e &&
+              prev[offset + kk - 1] < prev[offset + kk + 1])) ? kk + 1 : kk - 1;
+        int prevX = prev[offset + prevK];
+        int prevY = prevX - prevK;
+        while (x > prevX && y > prevY) {
+          matches.push_back(std::make_pair(--x, --y));
+        }
+        x = prevX;
+        y = prevY;
+      }
+      while (x > 0 && y > 0) {
+        matches.push_back(std::make_pair(--x, --y));
+      }
+      std::reverse(matches.begin() + first, matches.end());
+      return true;
+    }
+    trace.push_back(v);
+  }
+  return false;
+}
+
+/*
+ * Labels for the truth tokens [i, iEnd) which replace the algorithm tokens
+ * [j, jEnd). Each truth token takes the first entity start, else the first
+ * label, of its proportional share of the algorithm tokens.
+ */
+inline void projectGap(const vector<string>& algLabels, size_t j,
+    size_t jEnd, vector<string>& labels, size_t i, size_t iEnd,
+    string& pendingId) {
+  size_t numAlg = jEnd - j;
+  size_t numTruth = iEnd - i;
+
+  if (numTruth == 0) {
+    // Deleted tokens: an entity started here continues on the next match.
+    for (size_t g = j; g < jEnd; g++) {
+      if (isEntityStart(algLabels[g])) {
+        pendingId = algLabels[g];
+      } else if (algLabels[g] == "O") {
+        pendingId.clear();
+      }
+    }
+    return;
+  }
+
+  if (numAlg == 0) {
+    // Inserted tokens: inside an entity if it goes on after them.
+    bool inside = i > 0 && labels[i - 1] != "O" && jEnd < algLabels.size() &&
+      algLabels[jEnd] == "I";
+    for (size_t t = i; t < iEnd; t++) {
+      labels[t] = inside ? "I" : "O";
+    }
+    return;
+  }
+
+  size_t prevLo = SIZE_MAX;
+  for (size_t t = 0; t < numTruth; t++) {
+    size_t lo = t * numAlg / numTruth;
+    size_t hi = std::max(lo + 1, (t + 1) * numAlg / numTruth);
+    string& label = labels[i + t];
+    if (lo == prevLo) {
+      label = labels[i + t - 1] == "O" ? "O" : "I";
+      continue;
+    }
+
+    label = "O";
+    for (size_t g = j + lo; g < j + hi; g++) {
+      if (isEntityStart(algLabels[g])) {
+        label = algLabels[g];
+        break;
+      }
+      if (label == "O") {
+        label = algLabels[g];
+      }
+    }
+    if (label == "I" && !pendingId.empty()) {
+      label = pendingId;
+    }
+    pendingId.clear();
+    prevLo = lo;
+  }
+}
+
+/*
+ * Rewrite algWords onto the tokens of truthWords. Return false if the
+ * sentences differ in more than MAX_ALIGN_EDITS tokens.
+ */
+inline bool alignWords(const vector<string>& truthWords,
+    const vector<string>& algWords, vector<string>& alignedWords) {
+  vector<uint64_t> truthHashes(truthWords.size());
+  vector<uint64_t> algHashes(algWords.size());
+  vector<string> algLabels(algWords.size());
+  for (size_t i = 0; i < truthWords.size(); i++) {
+    truthHashes[i] = surfaceHash(truthWords[i]);
+  }
+  for (size_t j = 0; j < algWords.size(); j++) {
+    algHashes[j] = surfaceHash(algWords[j]);
+    algLabels[j] = getLabel(algWords[j]);
+  }
+
+  vector<std::pair<size_t, size_t>> matches;
+  if (!myersDiff(truthHashes, algHashes, MAX_ALIGN_EDITS, matches)) {
+    return false;
+  }
+
+  vector<string> labels(truthWords.size());
+  string pendingId;
+  size_t i = 0, j = 0;
+  for (size_t k = 0; k <= matches.size(); k++) {
+    size_t nextI = k < matches.size() ? matches[k].first : truthWords.size();
+    size_t nextJ = k < matches.size() ? matches[k].second : algWords.size();
+    projectGap(algLabels, j, nextJ, labels, i, nextI, pendingId);
+
+    if (k < matches.size()) {
+      labels[nextI] = algLabels[nextJ] == "I" && !pendingId.empty() ?
+        pendingId : algLabels[nextJ];
+      pendingId.clear();
+    }
+    i = nextI + 1;
+    j = nextJ + 1;
+  }
+
+  alignedWords.resize(truthWords.size());
+  for (size_t t = 0; t < truthWords.size(); t++) {
+    alignedWords[t] = truthWords[t].substr(0, truthWords[t].find('\\')) +
+      "\\?\\" + labels[t];
+  }
+  return true;
+}
@@ -0,0 +1,668 @@
+// Copyright 2020, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Yi-Chun Lin <circle40191@gmail.com>
+
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "frames.hpp"
+#include "utils.hpp"
+
+/*
+ * Asynchronous reading of the input files, which mostly live on NFS.
+ *
+ * A LineReader keeps READ_QUEUE_DEPTH reads of READ_BLOCK_SIZE bytes in
+ * flight ahead of the line being parsed, so the network round trips overlap
+ * with the parsing instead of stalling it. Random accesses (quickSeek,
+ * getRandomLine) submit all their probes at once with probeLines().
+ *
+ * Reads go through io_uring if the kernel supports it, otherwise through a
+ * pool of threads calling pread. Use --io to force one of them.
+ *
+ * Pipes ("-" for stdin) are read sequentially with plain read() calls. Byte
+ * offsets are counted all the same, but they cannot be sought.
+ *
+ * Files written by a FrameWriter are read through a FrameReader, so all
+ * offsets are those of the uncompressed text, see frames.hpp.
+ */
+
+const size_t READ_BLOCK_SIZE = 1 << 20;
+const size_t READ_QUEUE_DEPTH = 16;
+const size_t READ_PROBE_SIZE = 1 << 16;
+
+class ReadBackend {
+ public:
+  virtual ~ReadBackend() {}
+
+  // Start reading len bytes at offset into buf. At most the queue depth
+  // given to makeReadBackend() may be outstanding.
+  virtual void submit(int fd, char* buf, size_t len, uint64_t offset,
+      uint64_t tag) = 0;
+
+  // Block until one read finished. result is the byte count or -errno.
+  virtual void wait(uint64_t& tag, int64_t& result) = 0;
+};
+
+/*
+ * io_uring through the raw system calls. Submissions are queued and handed
+ * to the kernel in one io_uring_enter() on the next wait().
+ */
+class IoUringBackend : public ReadBackend {
+ public:
+  explicit IoUringBackend(unsigned depth) : _ringFd(-1), _numQueued(0),
+    _sqRing(MAP_FAILED), _cqRing(MAP_FAILED), _sqes(MAP_FAILED) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (fd < 0) {
+      return;
+    }
+
+    _sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    _cqRingSize = params.cq_off.cqes +
+      params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap) {
+      _sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+    }
+    _sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    _sqRing = mmap(NULL, _sqRingSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    _cqRing = singleMmap ? _sqRing : mmap(NULL, _cqRingSize,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+        IORING_OFF_CQ_RING);
+    _sqes = mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    _ringFd = fd;
+    if (_sqRing == MAP_FAILED || _cqRing == MAP_FAILED ||
+        _sqes == MAP_FAILED || !supportsRead()) {
+      release();
+      return;
+    }
+
+    char* sq = static_cast<char*>(_sqRing);
+    char* cq = static_cast<char*>(_cqRing);
+    _sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    _sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    _sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    _cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    _cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    _cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    _cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+  }
+
+  ~IoUringBackend() { release(); }
+
+  bool available() const { return _ringFd >= 0; }
+
+  void submit(int fd, char* buf, size_t len, uint64_t offset,
+      uint64_t tag) {
+    unsigned tail = *_sqTail;
+    unsigned idx = tail & _sqMask;
+    struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(_sqes) + idx;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = tag;
+    _sqArray[idx] = idx;
+    __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+    _numQueued++;
+  }
+
+  void wait(uint64_t& tag, int64_t& result) {
+    unsigned head = *_cqHead;
+    while (head == __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE)) {
+      int ret = syscall(__NR_io_uring_enter, _ringFd, _numQueued, 1,
+          IORING_ENTER_GETEVENTS, NULL, 0);
+      if (ret >= 0) {
+        _numQueued -= std::min(_numQueued, static_cast<unsigned>(ret));
+      } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        std::cout << "io_uring_enter failed: " << strerror(errno) <<
+          ", run with --io threads\n";
+        exit(1);
+      }
+    }
+    struct io_uring_cqe* cqe = _cqes + (head & _cqMask);
+    tag = cqe->user_data;
+    result = cqe->res;
+    __atomic_store_n(_cqHead, head + 1, __ATOMIC_RELEASE);
+  }
+
+ private:
+  // IORING_OP_READ came with Linux 5.6, as did IORING_REGISTER_PROBE.
+  bool supportsRead() const {
+    const size_t numOps = 256;
+    size_t size = sizeof(struct io_uring_probe) +
+      numOps * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe =
+      static_cast<struct io_uring_probe*>(calloc(1, size));
+    bool supported = syscall(__NR_io_uring_register, _ringFd,
+        IORING_REGISTER_PROBE, probe, numOps) >= 0 &&
+      probe->last_op >= IORING_OP_READ &&
+      (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+  }
+
+  void release() {
+    if (_sqes != MAP_FAILED) {
+      munmap(_sqes, _sqesSize);
+    }
+    if (_cqRing != MAP_FAILED && _cqRing != _sqRing) {
+      munmap(_cqRing, _cqRingSize);
+    }
+    if (_sqRing != MAP_FAILED) {
+      munmap(_sqRing, _sqRingSize);
+    }
+    _sqes = _cqRing = _sqRing = MAP_FAILED;
+    if (_ringFd >= 0) {
+      close(_ringFd);
+    }
+    _ringFd = -1;
+  }
+
+  int _ringFd;
+  unsigned _numQueued;
+  void* _sqRing;
+  void* _cqRing;
+  void* _sqes;
+  size_t _sqRingSize;
+  size_t _cqRingSize;
+  size_t _sqesSize;
+  unsigned* _sqTail;
+  unsigned _sqMask;
+  unsigned* _sqArray;
+  unsigned* _cqHead;
+  unsigned* _cqTail;
+  unsigned _cqMask;
+  struct io_uring_cqe* _cqes;
+};
+
+/*
+ * Fallback: one thread per queue slot, each blocking in pread.
+ */
+class ThreadPoolBackend : public ReadBackend {
+ public:
+  explicit ThreadPoolBackend(size_t numThreads) : _stop(false) {
+    for (size_t t = 0; t < numThreads; t++) {
+      _workers.push_back(std::thread([this]() { work(); }));
+    }
+  }
+
+  ~ThreadPoolBackend() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+    _requestReady.notify_all();
+    for (auto& worker : _workers) {
+      worker.join();
+    }
+  }
+
+  void submit(int fd, char* buf, size_t len, uint64_t offset,
+      uint64_t tag) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _requests.push_back({fd, buf, len, offset, tag});
+    }
+    _requestReady.notify_one();
+  }
+
+  void wait(uint64_t& tag, int64_t& result) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _resultReady.wait(lock, [this]() { return !_results.empty(); });
+    tag = _results.front().first;
+    result = _results.front().second;
+    _results.pop_front();
+  }
+
+ private:
+  struct Request {
+    int fd;
+    char* buf;
+    size_t len;
+    uint64_t offset;
+    uint64_t tag;
+  };
+
+  void work() {
+    while (true) {
+      Request request;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _requestReady.wait(lock, [this]() {
+            return _stop || !_requests.empty();
+            });
+        if (_stop) {
+          return;
+        }
+        request = _requests.front();
+        _requests.pop_front();
+      }
+
+      int64_t result = pread(request.fd, request.buf, request.len,
+          request.offset);
+      result = result < 0 ? -errno : result;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _results.push_back(std::make_pair(request.tag, result));
+      }
+      _resultReady.notify_one();
+    }
+  }
+
+  bool _stop;
+  std::mutex _mutex;
+  std::condition_variable _requestReady;
+  std::condition_variable _resultReady;
+  std::deque<Request> _requests;
+  std::deque<std::pair<uint64_t, int64_t>> _results;
+  vector<std::thread> _workers;
+};
+
+// Backend used by all LineReaders: "auto", "uring" or "threads".
+inline string& readBackendName() {
+  static string name = "auto";
+  return name;
+}
+
+#define IO_USAGE \
+  "  --io <auto|uring|threads>\n" \
+  "    How input files are read ahead. Default auto: io_uring if the " \
+  "kernel supports it, else a pool of reader threads.\n\n"
+
+inline void setReadBackend(int argc, char** argv) {
+  readBackendName() = getOption(argc, argv, "--io", "auto");
+}
+
+inline std::unique_ptr<ReadBackend> makeReadBackend(unsigned depth) {
+  if (readBackendName() != "threads") {
+    std::unique_ptr<IoUringBackend> uring(new IoUringBackend(depth));
+    if (uring->available()) {
+      return std::unique_ptr<ReadBackend>(uring.release());
+    }
+    if (readBackendName() == "uring") {
+      std::cout << "io_uring is not available, using reader threads\n";
+      readBackendName() = "threads";
+    }
+  }
+  return std::unique_ptr<ReadBackend>(new ThreadPoolBackend(depth));
+}
+
+// Whether filename ("-" for stdin) is a pipe or anything else but a file.
+inline bool isPipe(const string& filename) {
+  struct stat st;
+  int ret = filename == "-" ? fstat(STDIN_FILENO, &st) :
+    stat(filename.c_str(), &st);
+  return ret == 0 && !S_ISREG(st.st_mode);
+}
+
+/*
+ * Read a file line by line like std::getline on an ifstream, with
+ * read-ahead. tellg() is the offset of the next unread byte. The size of a
+ * pipe is unknown (UINT64_MAX) until its end was read.
+ */
+class LineReader {
+ public:
+  // First complete line after a probed offset, see probeLines().
+  struct ProbedLine {
+    bool found;
+    string line;
+    uint64_t end;
+  };
+
+  explicit LineReader(const string& filename) : _size(0), _pos(0),
+    _nextOffset(0), _readaheadEnd(0), _head(0), _started(false),
+    _pipe(false), _pipeBegin(0), _pipeEnd(0) {
+    _fd = filename == "-" ? dup(STDIN_FILENO) : open(filename.c_str(),
+        O_RDONLY);
+    struct stat st;
+    if (_fd >= 0 && fstat(_fd, &st) == 0) {
+      _pipe = !S_ISREG(st.st_mode);
+      _size = _pipe ? UINT64_MAX : st.st_size;
+    }
+    if (_fd >= 0 && !_pipe && filename != "-" && hasFrameIndex(filename)) {
+      _frames.reset(new FrameReader(filename));
+      if (!_frames->is_open()) {
+        std::cout << "Cannot read " << filename << ": its index " <<
+          filename << FRAME_INDEX_SUFFIX << " is damaged or does not match " <<
+          "the file\n";
+        exit(1);
+      }
+      _size = _frames->size();
+    }
+  }
+
+  ~LineReader() { close(); }
+
+  bool is_open() const { return _fd >= 0; }
+
+  // False for pipes, which only support getline().
+  bool seekable() const { return !_pipe; }
+
+  uint64_t size() const { return _size; }
+
+  uint64_t tellg() const { return _pos; }
+
+  bool eof() const { return _pos >= _size; }
+
+  void close() {
+    drain();
+    _frames.reset();
+    if (_fd >= 0) {
+      ::close(_fd);
+    }
+    _fd = -1;
+  }
+
+  // Continue reading at offset. Read-ahead stops at readaheadEnd; past it,
+  // blocks are only read when needed.
+  void seekg(uint64_t offset, uint64_t readaheadEnd = UINT64_MAX) {
+    if (_pipe) {
+      if (offset != _pos) {
+        std::cout << "Cannot seek in a pipe\n";
+        exit(1);
+      }
+      return;
+    }
+    if (_frames) {
+      _frames->seekg(offset);
+      _pos = _frames->tellg();
+      return;
+    }
+    drain();
+    if (!_backend) {
+      _backend = makeReadBackend(READ_QUEUE_DEPTH);
+      _blocks.resize(READ_QUEUE_DEPTH);
+    }
+    for (auto& block : _blocks) {
+      block.state = BLOCK_IDLE;
+    }
+    _pos = std::min(offset, _size);
+    _nextOffset = _pos;
+    _readaheadEnd = readaheadEnd;
+    _head = 0;
+    _started = true;
+    for (size_t i = 0; i < _blocks.size() && _nextOffset < std::min(
+          _size, _readaheadEnd); i++) {
+      submitBlock(i);
+    }
+  }
+
+  bool getline(string& line) {
+    if (_pipe) {
+      return getlinePipe(line);
+    }
+    if (_frames) {
+      bool extracted = _frames->getline(line);
+      _pos = _frames->tellg();
+      return extracted;
+    }
+    if (!_started) {
+      seekg(_pos);
+    }
+
+    line.clear();
+    bool extracted = false;
+    while (_pos < _size) {
+      Block& block = headBlock();
+      const char* begin = block.data.data() + (_pos - block.offset);
+      const char* end = block.data.data() + block.len;
+      const char* newline = static_cast<const char*>(
+          memchr(begin, '\n', end - begin));
+      extracted = true;
+      if (newline != NULL) {
+        line.append(begin, newline);
+        _pos += newline - begin + 1;
+        return true;
+      }
+      line.append(begin, end);
+      _pos += end - begin;
+    }
+    return extracted;
+  }
+
+  /*
+   * For each offset, read the first complete line starting after it, i.e.
+   * what seekg(offset) followed by two getline() calls gives on an ifstream.
+   * All probes are read concurrently. end is the offset after the line.
+   * Any read-ahead is dropped, call seekg() before the next getline().
+   */
+  void probeLines(const vector<uint64_t>& offsets,
+      vector<ProbedLine>& lines) {
+    if (_frames) {
+      probeFrames(offsets, lines);
+      return;
+    }
+    if (_started) {
+      drain();
+      _started = false;
+    }
+    if (!_backend) {
+      _backend = makeReadBackend(READ_QUEUE_DEPTH);
+      _blocks.resize(READ_QUEUE_DEPTH);
+    }
+
+    lines.assign(offsets.size(), ProbedLine());
+    vector<vector<char>> buffers(std::min(offsets.size(), READ_QUEUE_DEPTH),
+        vector<char>(READ_PROBE_SIZE));
+    vector<size_t> slotProbe(buffers.size());
+    vector<size_t> freeSlots;
+    for (size_t slot = 0; slot < buffers.size(); slot++) {
+      freeSlots.push_back(slot);
+    }
+
+    size_t numSubmitted = 0;
+    for (size_t numDone = 0; numDone < offsets.size(); numDone++) {
+      while (numSubmitted < offsets.size() && !freeSlots.empty()) {
+        size_t slot = freeSlots.back();
+        freeSlots.pop_back();
+        slotProbe[slot] = numSubmitted;
+        _backend->submit(_fd, buffers[slot].data(), READ_PROBE_SIZE,
+            offsets[numSubmitted], slot);
+        numSubmitted++;
+      }
+
+      uint64_t slot;
+      int64_t result;
+      _backend->wait(slot, result);
+      size_t p = slotProbe[slot];
+      finishProbe(offsets[p], buffers[slot].data(), result, lines[p]);
+      freeSlots.push_back(slot);
+    }
+  }
+
+ private:
+  enum BlockState { BLOCK_IDLE, BLOCK_IN_FLIGHT, BLOCK_DONE };
+
+  struct Block {
+    Block() : offset(0), len(0), state(BLOCK_IDLE) {}
+    vector<char> data;
+    uint64_t offset;
+    size_t len;
+    BlockState state;
+  };
+
+  void submitBlock(size_t i) {
+    Block& block = _blocks[i];
+    block.data.resize(READ_BLOCK_SIZE);
+    block.offset = _nextOffset;
+    block.len = std::min(static_cast<uint64_t>(READ_BLOCK_SIZE),
+        _size - _nextOffset);
+    block.state = BLOCK_IN_FLIGHT;
+    _backend->submit(_fd, block.data.data(), block.len, block.offset, i);
+    _nextOffset += block.len;
+  }
+
+  // Wait for one read and complete short or failed reads synchronously.
+  void waitBlock() {
+    uint64_t i;
+    int64_t result;
+    _backend->wait(i, result);
+    Block& block = _blocks[i];
+    size_t got = result > 0 ? result : 0;
+    while (got < block.len) {
+      ssize_t n = pread(_fd, block.data.data() + got, block.len - got,
+          block.offset + got);
+      if (n <= 0) {
+        // The file was truncated while reading it.
+        _size = std::min(_size, block.offset + got);
+        block.len = got;
+        break;
+      }
+      got += n;
+    }
+    block.state = BLOCK_DONE;
+  }
+
+  // The block holding _pos, recycling the blocks before it.
+  Block& headBlock() {
+    while (true) {
+      Block& block = _blocks[_head];
+      if (block.state == BLOCK_IDLE) {
+        // Past the read-ahead limit, read one block at a time.
+        submitBlock(_head);
+      }
+      while (block.state == BLOCK_IN_FLIGHT) {
+        waitBlock();
+      }
+      if (_pos < block.offset + block.len) {
+        return block;
+      }
+
+      block.state = BLOCK_IDLE;
+      if (_nextOffset < std::min(_size, _readaheadEnd)) {
+        submitBlock(_head);
+      }
+      _head = (_head + 1) % _blocks.size();
+    }
+  }
+
+  void drain() {
+    for (auto& block : _blocks) {
+      while (block.state == BLOCK_IN_FLIGHT) {
+        waitBlock();
+      }
+    }
+  }
+
+  bool getlinePipe(string& line) {
+    line.clear();
+    bool extracted = false;
+    while (true) {
+      if (_pipeBegin == _pipeEnd) {
+        _pipeBuffer.resize(READ_BLOCK_SIZE);
+        ssize_t n = read(_fd, _pipeBuffer.data(), _pipeBuffer.size());
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n <= 0) {
+          _size = _pos;
+          return extracted;
+        }
+        _pipeBegin = 0;
+        _pipeEnd = n;
+      }
+
+      const char* begin = _pipeBuffer.data() + _pipeBegin;
+      const char* end = _pipeBuffer.data() + _pipeEnd;
+      const char* newline = static_cast<const char*>(
+          memchr(begin, '\n', end - begin));
+      extracted = true;
+      if (newline != NULL) {
+        line.append(begin, newline);
+        _pipeBegin += newline - begin + 1;
+        _pos += newline - begin + 1;
+        return true;
+      }
+      line.append(begin, end);
+      _pipeBegin = _pipeEnd;
+      _pos += end - begin;
+    }
+  }
+
+  // probeLines() on a framed file, one offset after the other.
+  void probeFrames(const vector<uint64_t>& offsets,
+      vector<ProbedLine>& lines) {
+    lines.assign(offsets.size(), ProbedLine());
+    string skipped;
+    for (size_t p = 0; p < offsets.size(); p++) {
+      _frames->seekg(offsets[p]);
+      if (_frames->getline(skipped) && _frames->tellg() < _size) {
+        lines[p].found = _frames->getline(lines[p].line);
+        lines[p].end = _frames->tellg();
+      }
+    }
+    _frames->seekg(_pos);
+  }
+
+  void finishProbe(uint64_t offset, const char* buf, int64_t result,
+      ProbedLine& probe) {
+    string data(buf, result > 0 ? result : 0);
+    size_t lineBegin = string::npos;
+    size_t lineEnd = string::npos;
+    uint64_t readOffset = offset + data.size();
+
+    // Long lines or failed reads: continue synchronously.
+    while (true) {
+      if (lineBegin == string::npos) {
+        lineBegin = data.find('\n');
+        lineBegin = lineBegin == string::npos ? string::npos : lineBegin + 1;
+      }
+      if (lineBegin != string::npos) {
+        lineEnd = data.find('\n', lineBegin);
+      }
+      if (lineEnd != string::npos || readOffset >= _size) {
+        break;
+      }
+
+      char chunk[READ_PROBE_SIZE];
+      ssize_t n = pread(_fd, chunk, sizeof(chunk), readOffset);
+      if (n <= 0) {
+        break;
+      }
+      data.append(chunk, n);
+      readOffset += n;
+    }
+
+    if (lineBegin == string::npos || lineBegin >= data.size()) {
+      return;
+    }
+    lineEnd = lineEnd == string::npos ? data.size() : lineEnd;
+    probe.found = true;
+    probe.line = data.substr(lineBegin, lineEnd - lineBegin);
+    probe.end = offset + std::min(lineEnd + 1, data.size());
+  }
+
+  int _fd;
+  uint64_t _size;
+  uint64_t _pos;
+  uint64_t _nextOffset;
+  uint64_t _readaheadEnd;
+  size_t _head;
+  bool _started;
+  std::unique_ptr<ReadBackend> _backend;
+  vector<Block> _blocks;
+  bool _pipe;
+  vector<char> _pipeBuffer;
+  size_t _pipeBegin;
+  size_t _pipeEnd;
+  std::unique_ptr<FrameReader> _frames;
+};
@@ -0,0 +1,385 @@
+// Copyright 2020, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Yi-Chun Lin <circle40191@gmail.com>
+
+#pragma once
+
+#include <unordered_map>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <thread>
+#include "utils.hpp"
+
+using std::to_string;
+
+const double CONFIDENCE_LEVEL = 0.95;
+const uint64_t BOOTSTRAP_SEED = 20190401;
+const char BOOTSTRAP_MAGIC[] = "BOOTST01";
+
+/*
+ * Per-sentence InKB counts, written as fixed-size records to the
+ * sentence_counts file of each evaluation so two runs can be paired later.
+ * Sentences that could not be scored (token mismatch) have scored == 0.
+ */
+struct SentenceCounts {
+  uint64_t lineIdx;
+  uint16_t tp;
+  uint16_t fp;
+  uint16_t fn;
+  uint16_t scored;
+};
+
+inline double computeF1(const uint64_t& tp,
+    const uint64_t& fp, const uint64_t& fn) {
+  if (tp == 0 && fp == 0 && fn == 0) {
+    return 1.0;
+  }
+
+  if (tp == 0) {
+    return 0.0;
+  }
+
+  double p = static_cast<double>(tp) / (tp + fp);
+  double r = static_cast<double>(tp) / (tp + fn);
+  return p * r * 2 / (p + r);
+}
+
+inline uint16_t saturate16(const uint64_t n) {
+  return n > 0xFFFF ? 0xFFFF : static_cast<uint16_t>(n);
+}
+
+/*
+ * Bootstrap resampling of micro and macro F1 over sentences.
+ *
+ * Sentences are not kept individually: since almost all sentences share a
+ * handful of (tp, fp, fn) combinations, we only keep a histogram of them.
+ * Drawing n sentences with replacement is then a multinomial draw over the
+ * histogram cells, done as a chain of binomial draws, so one resample costs
+ * O(#cells) instead of O(n).
+ *
+ * In paired mode each cell holds the counts of both systems on the same
+ * sentence, which keeps the resamples of both systems aligned.
+ */
+class Bootstrap {
+ public:
+  struct Cell {
+    uint16_t counts[6];
+  };
+
+  explicit Bootstrap(bool paired) : _paired(paired), _total(0) {}
+
+  void add(const SentenceCounts& a) {
+    SentenceCounts none = {a.lineIdx, 0, 0, 0, 0};
+    add(a, none);
+  }
+
+  void add(const SentenceCounts& a, const SentenceCounts& b) {
+    uint64_t keyA = pack(a.tp, a.fp, a.fn);
+    uint64_t keyB = _paired ? pack(b.tp, b.fp, b.fn) : 0;
+    _histogram[std::make_pair(keyA, keyB)]++;
+    _total++;
+  }
+
+  // Add the sentences of other, which must have the same mode.
+  void add(const Bootstrap& other) {
+    for (const auto& elem : other._histogram) {
+      _histogram[elem.first] += elem.second;
+    }
+    _total += other._total;
+  }
+
+  uint64_t size() const { return _total; }
+
+  // Dump the histogram, for merge_stats_main to resample sharded runs.
+  void write(std::ostream& f) const {
+    f.write(BOOTSTRAP_MAGIC, sizeof(BOOTSTRAP_MAGIC) - 1);
+    writeValue<uint8_t>(f, _paired);
+    writeValue<uint64_t>(f, _histogram.size());
+    for (const auto& elem : _histogram) {
+      writeValue(f, elem.first.first);
+      writeValue(f, elem.first.second);
+      writeValue(f, elem.second);
+    }
+  }
+
+  // Add a histogram written by write(), false if it is damaged or of
+  // another mode.
+  bool read(std::istream& f) {
+    char magic[sizeof(BOOTSTRAP_MAGIC) - 1];
+    uint8_t paired;
+    uint64_t size;
+    if (!f.read(magic, sizeof(magic)) ||
+        memcmp(magic, BOOTSTRAP_MAGIC, sizeof(magic)) != 0 ||
+        !readValue(f, paired) || paired != _paired || !readValue(f, size)) {
+      return false;
+    }
+    Bootstrap other(_paired);
+    for (uint64_t i = 0; i < size; i++) {
+      std::pair<uint64_t, uint64_t> key;
+      uint64_t count;
+      if (!readValue(f, key.first) || !readValue(f, key.second) ||
+          !readValue(f, count)) {
+        return false;
+      }
+      other._histogram[key] += count;
+      other._total += count;
+    }
+    add(other);
+    return true;
+  }
+
+  // Draw numSamples resamples on all cores. Results only depend on seed and
+  // the histogram, not on the order the sentences were added in.
+  void run(const size_t numSamples, const uint64_t seed) {
+    vector<std::pair<std::pair<uint64_t, uint64_t>, uint64_t>> sorted(
+        _histogram.begin(), _histogram.end());
+    std::sort(sorted.begin(), sorted.end());
+    vector<std::pair<Cell, uint64_t>> cells;
+    for (const auto& elem : sorted) {
+      Cell cell;
+      unpack(elem.first.first, cell.counts);
+      unpack(elem.first.second, cell.counts + 3);
+      cells.push_back(std::make_pair(cell, elem.second));
+    }
+
+    for (int s = 0; s < 2; s++) {
+      _micro[s].assign(numSamples, 0.0);
+      _macro[s].assign(numSamples, 0.0);
+    }
+
+    if (_total == 0) {
+      return;
+    }
+
+    size_t numThreads = std::thread::hardware_concurrency();
+    numThreads = numThreads == 0 ? 1 : numThreads;
+    vector<std::thread> workers;
+    for (size_t t = 0; t < numThreads; t++) {
+      workers.push_back(std::thread([&, t]() {
+        vector<uint64_t> draws(cells.size());
+        for (size_t b = t; b < numSamples; b += numThreads) {
+          std::mt19937_64 rng(seed + b);
+          multinomial(cells, rng, draws);
+          resample(cells, draws, b);
+        }
+      }));
+    }
+
+    for (auto& worker : workers) {
+      worker.join();
+    }
+  }
+
+  // Percentile confidence interval of system s, e.g. level = 0.95.
+  std::pair<double, double> microCI(int s, double level) const {
+    return percentiles(_micro[s], level);
+  }
+
+  std::pair<double, double> macroCI(int s, double level) const {
+    return percentiles(_macro[s], level);
+  }
+
+  // Two-sided p-value of "both systems perform equally" (paired mode only).
+  double microPValue(double observedDiff) const {
+    return pValue(_micro[0], _micro[1], observedDiff);
+  }
+
+  double macroPValue(double observedDiff) const {
+    return pValue(_macro[0], _macro[1], observedDiff);
+  }
+
+ private:
+  struct PairHash {
+    size_t operator()(const std::pair<uint64_t, uint64_t>& key) const {
+      return std::hash<uint64_t>()(key.first * 0x9E3779B97F4A7C15ULL ^
+          key.second);
+    }
+  };
+
+  static uint64_t pack(uint16_t tp, uint16_t fp, uint16_t fn) {
+    return (static_cast<uint64_t>(tp) << 32) |
+      (static_cast<uint64_t>(fp) << 16) | fn;
+  }
+
+  static void unpack(uint64_t key, uint16_t* counts) {
+    counts[0] = (key >> 32) & 0xFFFF;
+    counts[1] = (key >> 16) & 0xFFFF;
+    counts[2] = key & 0xFFFF;
+  }
+
+  void multinomial(const vector<std::pair<Cell, uint64_t>>& cells,
+      std::mt19937_64& rng, vector<uint64_t>& draws) const {
+    uint64_t remainingDraws = _total;
+    uint64_t remainingWeight = _total;
+    for (size_t k = 0; k < cells.size(); k++) {
+      uint64_t weight = cells[k].second;
+      if (remainingDraws == 0 || weight >= remainingWeight) {
+        draws[k] = remainingDraws;
+      } else {
+        std::binomial_distribution<uint64_t> binomial(
+            remainingDraws, static_cast<double>(weight) / remainingWeight);
+        draws[k] = binomial(rng);
+      }
+      remainingDraws -= draws[k];
+      remainingWeight -= weight;
+    }
+  }
+
+  void resample(const vector<std::pair<Cell, uint64_t>>& cells,
+      const vector<uint64_t>& draws, size_t b) {
+    for (int s = 0; s < (_paired ? 2 : 1); s++) {
+      uint64_t tp = 0, fp = 0, fn = 0;
+      double f1Sum = 0.0;
+      for (size_t k = 0; k < cells.size(); k++) {
+        const uint16_t* c = cells[k].first.counts + 3 * s;
+        tp += draws[k] * c[0];
+        fp += draws[k] * c[1];
+        fn += draws[k] * c[2];
+        f1Sum += draws[k] * computeF1(c[0], c[1], c[2]);
+      }
+      _micro[s][b] = computeF1(tp, fp, fn);
+      _macro[s][b] = f1Sum / _total;
+    }
+  }
+
+  static std::pair<double, double> percentiles(vector<double> values,
+      double level) {
+    if (values.empty()) {
+      return std::make_pair(0.0, 0.0);
+    }
+    std::sort(values.begin(), values.end());
+    size_t lo = static_cast<size_t>((1.0 - level) / 2 * (values.size() - 1));
+    size_t hi = values.size() - 1 - lo;
+    return std::make_pair(values[lo], values[hi]);
+  }
+
+  // Shifted paired bootstrap: how often does the resampled difference
+  // deviate from the observed one by at least the observed difference.
+  static double pValue(const vector<double>& a, const vector<double>& b,
+      double observedDiff) {
+    uint64_t extreme = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+      double diff = a[i] - b[i];
+      if (std::abs(diff - observedDiff) >= std::abs(observedDiff)) {
+        extreme++;
+      }
+    }
+    return (extreme + 1.0) / (a.size() + 1.0);
+  }
+
+  bool _paired;
+  uint64_t _total;
+  std::unordered_map<std::pair<uint64_t, uint64_t>, uint64_t, PairHash>
+    _histogram;
+  vector<double> _micro[2];
+  vector<double> _macro[2];
+};
+
+inline bool readSentenceCounts(std::ifstream& f, SentenceCounts& c) {
+  return static_cast<bool>(
+      f.read(reinterpret_cast<char*>(&c), sizeof(SentenceCounts)));
+}
+
+inline void writeSentenceCounts(std::ofstream& f, const SentenceCounts& c) {
+  f.write(reinterpret_cast<const char*>(&c), sizeof(SentenceCounts));
+}
+
+/*
+ * Whether a paired test against pairedCountsFile ("" for none) can run with
+ * numSamples resamples. Prints the reason if not.
+ */
+inline bool checkPaired(const string& pairedCountsFile,
+    const size_t numSamples) {
+  if (pairedCountsFile.empty()) {
+    return true;
+  }
+  if (numSamples == 0) {
+    std::cout << "--paired needs --bootstrap > 0\n";
+    return false;
+  }
+  std::ifstream fPaired(pairedCountsFile.c_str(), std::ios::binary);
+  if (!fPaired.is_open()) {
+    std::cout << "Cannot open " << pairedCountsFile << ", evaluate the " <<
+      "other result with --keep-counts\n";
+    return false;
+  }
+  return true;
+}
+
+// The stat lines of the confidence intervals of micro and macro F1.
+inline string bootstrapCIStats(const size_t numSamples,
+    const std::pair<double, double>& microCI,
+    const std::pair<double, double>& macroCI) {
+  std::stringstream ss;
+  ss << printStat("bootstrap_samples", to_string(numSamples));
+  ss << printStat("confidence_level", to_string(CONFIDENCE_LEVEL));
+  ss << printStat("micro_F1_InKB_ci_low", to_string(microCI.first));
+  ss << printStat("micro_F1_InKB_ci_high", to_string(microCI.second));
+  ss << printStat("macro_F1_InKB_ci_low", to_string(macroCI.first));
+  ss << printStat("macro_F1_InKB_ci_high", to_string(macroCI.second));
+  return ss.str();
+}
+
+/*
+ * Run a paired bootstrap test of the sentence_counts file of this run
+ * against pairedCountsFile. The two runs must come from the same ground
+ * truth, i.e. list the same sentences in the same order.
+ */
+inline string pairedBootstrapStats(const string& countsFile,
+    const string& pairedCountsFile, const size_t numSamples) {
+  std::stringstream ss;
+  std::ifstream fCounts(countsFile.c_str(), std::ios::binary);
+  std::ifstream fPaired(pairedCountsFile.c_str(), std::ios::binary);
+  SentenceCounts a, b;
+  uint64_t pairedTp = 0, pairedFp = 0, pairedFn = 0;
+  uint64_t ownTp = 0, ownFp = 0, ownFn = 0;
+  double pairedF1Sum = 0.0, ownF1Sum = 0.0;
+  Bootstrap pair(true);
+
+  if (!fCounts.is_open() || !fPaired.is_open()) {
+    std::cout << "Cannot open " << (fCounts.is_open() ? pairedCountsFile :
+        countsFile) << ", skip paired test\n";
+    return "";
+  }
+
+  while (readSentenceCounts(fCounts, a)) {
+    if (!readSentenceCounts(fPaired, b) || b.lineIdx != a.lineIdx) {
+      std::cout << "Sentences differ from " << pairedCountsFile <<
+        " at line " << a.lineIdx << ", skip paired test\n";
+      return "";
+    }
+
+    if (a.scored && b.scored) {
+      pair.add(a, b);
+      ownTp += a.tp;
+      ownFp += a.fp;
+      ownFn += a.fn;
+      ownF1Sum += computeF1(a.tp, a.fp, a.fn);
+      pairedTp += b.tp;
+      pairedFp += b.fp;
+      pairedFn += b.fn;
+      pairedF1Sum += computeF1(b.tp, b.fp, b.fn);
+    }
+  }
+
+  if (pair.size() == 0) {
+    return "";
+  }
+
+  // Differences are taken over the sentences scored in both runs only.
+  double microDiff = computeF1(ownTp, ownFp, ownFn) -
+    computeF1(pairedTp, pairedFp, pairedFn);
+  double macroDiff = (ownF1Sum - pairedF1Sum) / pair.size();
+
+  pair.run(numSamples, BOOTSTRAP_SEED);
+  ss << printStat("paired_counts_file", pairedCountsFile);
+  ss << printStat("paired_num_sentences", to_string(pair.size()));
+  ss << printStat("paired_micro_F1_InKB_diff", to_string(microDiff));
+  ss << printStat("paired_micro_F1_InKB_p_value",
+      to_string(pair.microPValue(microDiff)));
+  ss << printStat("paired_macro_F1_InKB_diff", to_string(macroDiff));
+  ss << printStat("paired_macro_F1_InKB_p_value",
+      to_string(pair.macroPValue(macroDiff)));
+  return ss.str();
+}
@@ -0,0 +1,294 @@
+// Copyright 2020, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Yi-Chun Lin <circle40191@gmail.com>
+
+#pragma once
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include "utils.hpp"
+
+/*
+ * Deduplication of IOB sentences in bounded memory.
+ *
+ * Each sentence (text and annotations, without the line number) is reduced
+ * to a 64-bit fingerprint. A FingerprintSet keeps the fingerprints seen so
+ * far: new ones go into an in-memory hash table, which is written to disk as
+ * a sorted run whenever it is full. A Bloom filter over all fingerprints
+ * answers most lookups of new sentences without touching the runs; a
+ * positive answer is verified exactly against the table and the runs.
+ *
+ * Two different sentences are only mistaken for duplicates if their 64-bit
+ * fingerprints collide, i.e. with probability about n^2 / 2^65 for n
+ * sentences.
+ */
+
+const uint64_t DEDUP_MEMORY_MB = 1024;
+const double BLOOM_BITS_PER_KEY = 10.0;
+// Lower bound of the average IOB line length, to estimate the number of
+// keys from the file size. ClueWeb lines average about 75 bytes.
+const uint64_t DEDUP_LINE_BYTES = 64;
+// The table is spilled at this load factor.
+const double DEDUP_TABLE_LOAD = 0.5;
+
+// 64-bit multiply, folding the high into the low half.
+inline uint64_t foldedMultiply(uint64_t a, uint64_t b) {
+  __uint128_t r = static_cast<__uint128_t>(a) * b;
+  return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+}
+
+inline uint64_t load64(const char* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/*
+ * Fast 64-bit hash of len bytes, consuming 16 bytes per multiplication
+ * (after wyhash).
+ */
+inline uint64_t hash64(const char* data, size_t len) {
+  const uint64_t P0 = 0xa0761d6478bd642fULL;
+  const uint64_t P1 = 0xe7037ed1a0b428dbULL;
+  const uint64_t P2 = 0x8ebc6af09c88c6e3ULL;
+  uint64_t h = P0;
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    h = foldedMultiply(load64(data + i) ^ P1, load64(data + i + 8) ^ h);
+  }
+
+  char tail[16] = {0};
+  memcpy(tail, data + i, len - i);
+  h = foldedMultiply(load64(tail) ^ P1, load64(tail + 8) ^ h);
+  return foldedMultiply(h ^ len, P2);
+}
+
+// Fingerprint of an IOB line: everything after the line number.
+inline uint64_t sentenceFingerprint(const string& line) {
+  std::size_t pos = line.find('\t');
+  pos = pos == string::npos ? 0 : pos + 1;
+  size_t len = line.size() - pos;
+  if (len > 0 && line[line.size() - 1] == '\n') {
+    len--;
+  }
+  return hash64(line.data() + pos, len);
+}
+
+class BloomFilter {
+ public:
+  BloomFilter(uint64_t numBits, uint64_t expectedKeys) :
+    _numBits(std::max(numBits, uint64_t(64))),
+    _bits((_numBits + 63) / 64, 0) {
+    double bitsPerKey = expectedKeys == 0 ? BLOOM_BITS_PER_KEY :
+      static_cast<double>(_numBits) / expectedKeys;
+    _numProbes = std::max(1, std::min(16,
+          static_cast<int>(std::lround(bitsPerKey * std::log(2.0)))));
+  }
+
+  // Keys are fingerprints, i.e. already hashed.
+  void add(uint64_t key) {
+    uint64_t delta = rotate(key);
+    for (int i = 0; i < _numProbes; i++, key += delta) {
+      uint64_t bit = position(key);
+      _bits[bit / 64] |= uint64_t(1) << (bit % 64);
+    }
+  }
+
+  bool mayContain(uint64_t key) const {
+    uint64_t delta = rotate(key);
+    for (int i = 0; i < _numProbes; i++, key += delta) {
+      uint64_t bit = position(key);
+      if ((_bits[bit / 64] & (uint64_t(1) << (bit % 64))) == 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  uint64_t bytes() const { return _bits.size() * sizeof(uint64_t); }
+
+ private:
+  static uint64_t rotate(uint64_t key) { return (key >> 32 | key << 32) | 1; }
+
+  uint64_t position(uint64_t key) const {
+    return (static_cast<__uint128_t>(key) * _numBits) >> 64;
+  }
+
+  uint64_t _numBits;
+  vector<uint64_t> _bits;
+  int _numProbes;
+};
+
+class FingerprintSet {
+ public:
+  /*
+   * Use about memoryBytes of memory, half of it for the Bloom filter.
+   * expectedKeys (0 if unknown) limits the Bloom filter to
+   * BLOOM_BITS_PER_KEY bits per key. Runs are written to
+   * <runPrefix>.<i> and removed by the destructor.
+   */
+  FingerprintSet(const string& runPrefix, uint64_t memoryBytes,
+      uint64_t expectedKeys) : _runPrefix(runPrefix),
+    _bloom(bloomBits(memoryBytes, expectedKeys), expectedKeys),
+    _tableSize(0), _numInserted(0), _numDuplicates(0), _numVerified(0) {
+    uint64_t tableBytes = memoryBytes - std::min(memoryBytes, _bloom.bytes());
+    size_t slots = 1024;
+    while (slots * 2 * sizeof(uint64_t) <= tableBytes) {
+      slots *= 2;
+    }
+    _table.assign(slots, 0);
+  }
+
+  ~FingerprintSet() {
+    for (size_t r = 0; r < _runs.size(); r++) {
+      munmap(const_cast<uint64_t*>(_runs[r].keys),
+          _runs[r].size * sizeof(uint64_t));
+      remove(runFile(r).c_str());
+    }
+  }
+
+  // Add fingerprint, return false if it was already in the set.
+  bool insert(uint64_t fingerprint) {
+    // 0 marks empty table slots.
+    fingerprint += fingerprint == 0;
+
+    if (_bloom.mayContain(fingerprint)) {
+      _numVerified++;
+      if (tableContains(fingerprint) || runsContain(fingerprint)) {
+        _numDuplicates++;
+        return false;
+      }
+    } else {
+      _bloom.add(fingerprint);
+    }
+
+    tableInsert(fingerprint);
+    _numInserted++;
+    if (_tableSize >= _table.size() * DEDUP_TABLE_LOAD) {
+      spill();
+    }
+    return true;
+  }
+
+  uint64_t numInserted() const { return _numInserted; }
+  uint64_t numDuplicates() const { return _numDuplicates; }
+  // Lookups which had to be verified against the table and the runs.
+  uint64_t numVerified() const { return _numVerified; }
+  size_t numRuns() const { return _runs.size(); }
+
+  // Zero the counters, e.g. after re-inserting the output of a resumed run.
+  void resetCounts() {
+    _numInserted = 0;
+    _numDuplicates = 0;
+    _numVerified = 0;
+  }
+
+ private:
+  struct Run {
+    const uint64_t* keys;
+    size_t size;
+  };
+
+  static uint64_t bloomBits(uint64_t memoryBytes, uint64_t expectedKeys) {
+    uint64_t bits = memoryBytes / 2 * 8;
+    if (expectedKeys > 0) {
+      bits = std::min(bits, static_cast<uint64_t>(
+            expectedKeys * BLOOM_BITS_PER_KEY));
+    }
+    return bits;
+  }
+
+  string runFile(size_t r) const {
+    return _runPrefix + "." + std::to_string(r);
+  }
+
+  size_t slot(uint64_t fingerprint) const {
+    return (static_cast<__uint128_t>(fingerprint) * _table.size()) >> 64;
+  }
+
+  bool tableContains(uint64_t fingerprint) const {
+    for (size_t i = slot(fingerprint); _table[i] != 0;
+        i = (i + 1) % _table.size()) {
+      if (_table[i] == fingerprint) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void tableInsert(uint64_t fingerprint) {
+    size_t i = slot(fingerprint);
+    while (_table[i] != 0) {
+      i = (i + 1) % _table.size();
+    }
+    _table[i] = fingerprint;
+    _tableSize++;
+  }
+
+  bool runsContain(uint64_t fingerprint) const {
+    for (const Run& run : _runs) {
+      if (std::binary_search(run.keys, run.keys + run.size, fingerprint)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Write the table as a sorted run and map it for the lookups. The page
+  // cache decides how much of the runs stays in memory.
+  void spill() {
+    vector<uint64_t> keys;
+    keys.reserve(_tableSize);
+    for (uint64_t& key : _table) {
+      if (key != 0) {
+        keys.push_back(key);
+        key = 0;
+      }
+    }
+    _tableSize = 0;
+    std::sort(keys.begin(), keys.end());
+
+    string filename = runFile(_runs.size());
+    std::ofstream fRun(filename.c_str(), std::ios::binary);
+    fRun.write(reinterpret_cast<const char*>(keys.data()),
+        keys.size() * sizeof(uint64_t));
+    fRun.close();
+    if (!fRun) {
+      std::cout << "Cannot write " << filename << "\n";
+      exit(1);
+    }
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    void* data = fd < 0 ? MAP_FAILED : mmap(NULL,
+        keys.size() * sizeof(uint64_t), PROT_READ, MAP_SHARED, fd, 0);
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (data == MAP_FAILED) {
+      std::cout << "Cannot map " << filename << "\n";
+      exit(1);
+    }
+    _runs.push_back({static_cast<const uint64_t*>(data), keys.size()});
+  }
+
+  string _runPrefix;
+  BloomFilter _bloom;
+  vector<uint64_t> _table;
+  size_t _tableSize;
+  vector<Run> _runs;
+  uint64_t _numInserted;
+  uint64_t _numDuplicates;
+  uint64_t _numVerified;
+};
+
+inline void printDedupStats(const FingerprintSet& seen) {
+  uint64_t total = seen.numInserted() + seen.numDuplicates();
+  printf("\nDedup: %lu of %lu lines dropped as duplicates (%.2f%%), "
+      "%lu runs on disk\n", seen.numDuplicates(), total,
+      total == 0 ? 0.0 : seen.numDuplicates() * 100.0 / total,
+      seen.numRuns());
+}
@@ -0,0 +1,94 @@
+// Copyright 2020, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Yi-Chun Lin <circle40191@gmail.com>
+
+#include <fstream>
+#include "async_reader.hpp"
+#include "dedup.hpp"
+#include "frames.hpp"
+#include "pipeline.hpp"
+#include "trace.hpp"
+#include "utils.hpp"
+
+using std::cout;
+
+// One input line and its fingerprint.
+struct IobLine {
+  string line;
+  uint64_t fingerprint;
+};
+
+/*
+ * Copy the IOB file inFile to outFile, dropping every line whose text and
+ * annotations already occurred in an earlier line. The line numbers are
+ * kept, see dedup.hpp.
+ */
+void dedupIOB(const string& inFile, const string& outFile,
+    const uint64_t memoryBytes, const bool compress) {
+  LineReader fIn(inFile);
+  std::unique_ptr<std::ostream> fOut = openOutput(outFile, compress);
+  uint64_t fileSize = fIn.size();
+  // Without a size (stdin) the Bloom filter takes all of its memory.
+  uint64_t expectedKeys = fIn.seekable() ?
+    fileSize / DEDUP_LINE_BYTES + 1 : 0;
+  FingerprintSet seen(outFile + ".dedup", memoryBytes, expectedKeys);
+  auto readLine = lineSource(fIn);
+
+  Pipeline<IobLine>()
+    .source("read_lines", [&](IobLine& item) { return readLine(item.line); })
+    .transform("fingerprint", [](IobLine& item) {
+        item.fingerprint = sentenceFingerprint(item.line);
+      })
+    .sink("write_output", [&](IobLine& item) {
+        if (seen.insert(item.fingerprint)) {
+          *fOut << item.line << '\n';
+        }
+      })
+    .progress([&](uint64_t) {
+        if (fIn.seekable()) {
+          printPercent(fIn.tellg(), fileSize);
+        }
+      })
+    .run();
+
+  printDedupStats(seen);
+  fIn.close();
+  fOut.reset();
+}
+
+int main(int argc, char** argv) {
+  startTrace(argc, argv);
+  setReadBackend(argc, argv);
+  vector<string> args = getPositionalArgs(argc, argv,
+      {"--dedup-memory", "--trace", "--io"});
+  if (args.size() < 2) {
+    cout << "\nUsage: \n" <<
+      "  dedup_iob_main <iob_file> <output_file> " <<
+      "[ --dedup-memory <MB> ] [ --trace <trace.json> ]\n" <<
+      "    [ --compress ] [ --io <auto|uring|threads> ]\n" <<
+      "\nDescription: \n" <<
+      "  Drop the lines of an IOB file whose text and annotations already " <<
+      "occurred in an earlier line, and report the duplication ratio.\n\n" <<
+      "  <iob_file>\n" <<
+      "    One sentence per line, LINE_NO <TAB> WORD1\\TAG1\\[IOB] ..., " <<
+      "e.g. generated by gen_clueweb_freebase_iob_main.\n" <<
+      "    \"-\" to read from stdin. Plain or written with --compress.\n\n" <<
+      "  --dedup-memory <MB>\n" <<
+      "    Memory for the set of seen lines, which is spilled to disk " <<
+      "beyond it. Default " << DEDUP_MEMORY_MB << ".\n\n" <<
+      "  --compress\n" <<
+      "    Write <output_file> in seekable compressed frames, see " <<
+      "frames.hpp.\n\n" <<
+      TRACE_USAGE <<
+      IO_USAGE;
+    return 1;
+  }
+
+  uint64_t memoryBytes = getCountOption(argc, argv, "--dedup-memory",
+      DEDUP_MEMORY_MB) << 20;
+  cout << "\nOutput path: " << args[1] << "\n";
+  dedupIOB(args[0], args[1], memoryBytes,
+      hasOption(argc, argv, "--compress"));
+  cout << "\nDone!\n\n";
+  return 0;
+}
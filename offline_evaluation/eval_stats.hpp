@@ -0,0 +1,226 @@
+// Copyright 2020, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Yi-Chun Lin <circle40191@gmail.com>
+
+#pragma once
+
+#include <unordered_map>
+#include "bootstrap.hpp"
+#include "utils.hpp"
+
+/*
+ * Order independent sum of values in [0, 1].
+ *
+ * Each value is rounded to a fixed point number with 62 fractional bits and
+ * summed as an integer, so partial sums can be merged in any order and
+ * still give exactly the same result as a single pass.
+ */
+class ExactSum {
+ public:
+  ExactSum() : _fixed(0) {}
+
+  void add(const double value) {
+    _fixed += static_cast<uint64_t>(std::llround(std::ldexp(value, 62)));
+  }
+
+  void add(const ExactSum& other) { _fixed += other._fixed; }
+
+  double value() const {
+    return std::ldexp(static_cast<double>(_fixed), -62);
+  }
+
+  // Lossless text form: high and low 64 bits in hex.
+  string str() const {
+    std::stringstream ss;
+    ss << std::hex << static_cast<uint64_t>(_fixed >> 64) << " " <<
+      static_cast<uint64_t>(_fixed);
+    return ss.str();
+  }
+
+  void parse(const string& s) {
+    std::stringstream ss(s);
+    uint64_t hi = 0, lo = 0;
+    ss >> std::hex >> hi >> lo;
+    _fixed = (static_cast<unsigned __int128>(hi) << 64) | lo;
+  }
+
+ private:
+  unsigned __int128 _fixed;
+};
+
+/*
+ * Counters accumulated over the evaluated sentences.
+ */
+struct EvalStats {
+  EvalStats() : microTp(0), microFp(0), microFn(0) {
+    for (const char* tag : {"B", "I", "O", "E", "S"}) {
+      statsBIOES[tag] = {{"tp", 0}, {"fp", 0}, {"fn", 0}};
+    }
+    statsSentence = {
+      {"num_total", 0},
+      {"num_correct", 0},
+      {"num_wrong", 0},
+      {"num_mismatch", 0},
+      {"num_aligned", 0},
+    };
+  }
+
+  void add(const EvalStats& other) {
+    for (const auto& elem : other.statsBIOES) {
+      for (const auto& elem2 : elem.second) {
+        statsBIOES[elem.first][elem2.first] += elem2.second;
+      }
+    }
+    for (const auto& elem : other.statsSentence) {
+      statsSentence[elem.first] += elem.second;
+    }
+    microTp += other.microTp;
+    microFp += other.microFp;
+    microFn += other.microFn;
+    macroF1Sum.add(other.macroF1Sum);
+  }
+
+  uint64_t numTokens() const {
+    uint64_t tokens = 0;
+    for (const auto& elem : statsBIOES) {
+      tokens += elem.second.at("tp") + elem.second.at("fn");
+    }
+    return tokens;
+  }
+
+  std::unordered_map<string, std::unordered_map<string, uint64_t>> statsBIOES;
+  std::unordered_map<string, uint64_t> statsSentence;
+  uint64_t microTp;
+  uint64_t microFp;
+  uint64_t microFn;
+  ExactSum macroF1Sum;
+};
+
+inline double microF1(const EvalStats& stats) {
+  return computeF1(stats.microTp, stats.microFp, stats.microFn);
+}
+
+inline double macroF1(const EvalStats& stats) {
+  return stats.macroF1Sum.value() / (stats.statsSentence.at("num_total") -
+      stats.statsSentence.at("num_mismatch"));
+}
+
+inline string printCounts(const EvalStats& stats) {
+  std::stringstream ss;
+  ss << printStat("micro_Tp", to_string(stats.microTp));
+  ss << printStat("micro_Fp", to_string(stats.microFp));
+  ss << printStat("micro_Fn", to_string(stats.microFn));
+
+  for (const auto& elem : stats.statsSentence) {
+    ss << printStat(elem.first, to_string(elem.second));
+  }
+
+  for (const auto& elem : stats.statsBIOES) {
+    string key = elem.first + "_";
+    for (const auto& elem2 : elem.second) {
+      ss << printStat(key + elem2.first, to_string(elem2.second));
+    }
+  }
+  return ss.str();
+}
+
+/*
+ * Write the stat file read by the web interface. Used by evaluate_main and
+ * merge_stats_main so that a merged result is identical to a single run.
+ */
+inline void writeStat(std::ofstream& fStat, const EvalStats& stats,
+    const size_t durationSeconds, const size_t bootstrapSeconds,
+    const string& algFilename, const string& filesizeNerNed,
+    const string& filesizeNer, const string& bootstrap) {
+  fStat << "{\n";
+
+  fStat << printStat("duration", getDuration(durationSeconds));
+  fStat << printStat("duration_bootstrap", getDuration(bootstrapSeconds));
+  fStat << printStat("alg_filename", algFilename);
+  fStat << printStat("filesize_ner_ned", filesizeNerNed);
+  fStat << printStat("filesize_ner", filesizeNer);
+  fStat << printStat("micro_F1_InKB", to_string(microF1(stats)));
+  fStat << printStat("macro_F1_InKB", to_string(macroF1(stats)));
+  fStat << printCounts(stats);
+  fStat << bootstrap;
+  fStat << "  \"dummy\": \"tail\"\n}\n";
+}
+
+/*
+ * Partial result of evaluating the byte range [beginOffset, endOffset) of an
+ * algorithm output. Unlike the stat file it only holds raw counters, so any
+ * number of partials can be merged exactly by merge_stats_main.
+ */
+struct EvalPartial {
+  EvalStats stats;
+  string algFilename;
+  uint64_t beginOffset;
+  uint64_t endOffset;
+  size_t durationSeconds;
+};
+
+inline void writePartial(std::ofstream& f, const EvalPartial& partial) {
+  const EvalStats& stats = partial.stats;
+  f << "alg_filename " << partial.algFilename << "\n";
+  f << "begin_offset " << partial.beginOffset << "\n";
+  f << "end_offset " << partial.endOffset << "\n";
+  f << "duration_seconds " << partial.durationSeconds << "\n";
+  f << "micro_Tp " << stats.microTp << "\n";
+  f << "micro_Fp " << stats.microFp << "\n";
+  f << "micro_Fn " << stats.microFn << "\n";
+  f << "macro_F1_sum " << stats.macroF1Sum.str() << "\n";
+  for (const auto& elem : stats.statsSentence) {
+    f << elem.first << " " << elem.second << "\n";
+  }
+  for (const auto& elem : stats.statsBIOES) {
+    for (const auto& elem2 : elem.second) {
+      f << elem.first << "_" << elem2.first << " " << elem2.second << "\n";
+    }
+  }
+}
+
+inline bool readPartial(std::ifstream& f, EvalPartial& partial) {
+  EvalStats& stats = partial.stats;
+  std::unordered_map<string, string> values;
+  string line;
+
+  while (std::getline(f, line)) {
+    std::size_t pos = line.find(' ');
+    if (pos != string::npos) {
+      values[line.substr(0, pos)] = line.substr(pos + 1);
+    }
+  }
+
+  for (const char* key : {"alg_filename", "begin_offset", "end_offset",
+      "duration_seconds", "micro_Tp", "micro_Fp", "micro_Fn",
+      "macro_F1_sum"}) {
+    if (values.find(key) == values.end()) {
+      return false;
+    }
+  }
+
+  partial.algFilename = values["alg_filename"];
+  partial.beginOffset = std::stoull(values["begin_offset"]);
+  partial.endOffset = std::stoull(values["end_offset"]);
+  partial.durationSeconds = std::stoull(values["duration_seconds"]);
+  stats.microTp = std::stoull(values["micro_Tp"]);
+  stats.microFp = std::stoull(values["micro_Fp"]);
+  stats.microFn = std::stoull(values["micro_Fn"]);
+  stats.macroF1Sum.parse(values["macro_F1_sum"]);
+  for (auto& elem : stats.statsSentence) {
+    if (values.find(elem.first) == values.end()) {
+      return false;
+    }
+    elem.second = std::stoull(values[elem.first]);
+  }
+  for (auto& elem : stats.statsBIOES) {
+    for (auto& elem2 : elem.second) {
+      string key = elem.first + "_" + elem2.first;
+      if (values.find(key) == values.end()) {
+        return false;
+      }
+      elem2.second = std::stoull(values[key]);
+    }
+  }
+  return true;
+}
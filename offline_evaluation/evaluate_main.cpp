@@ -4,330 +4,573 @@
 
 #include <unordered_map>
 #include <iterator>
-#include <tuple>
 #include <sys/stat.h>
+#include <unistd.h>
+#include "async_reader.hpp"
+#include "bootstrap.hpp"
+#include "eval_stats.hpp"
+#include "evaluator.h"
+#include "frames.hpp"
+#include "sketches.hpp"
+#include "trace.hpp"
 #include "utils.hpp"
 
 using std::cout;
 using std::to_string;
 
-#define NERNED_CORRECT 0
-#define NERNED_WRONG 1
-#define NERNED_MISMATCH 2
-
-std::unordered_map<string, unsigned int> flagBitMap({
-    {"S_fp", (1 << 0)},
-    {"B_fp", (1 << 1)},
-    {"I_fp", (1 << 2)},
-    {"E_fp", (1 << 3)},
-    {"O_fp", (1 << 4)},
-    {"S_fn", (1 << 5)},
-    {"B_fn", (1 << 6)},
-    {"I_fn", (1 << 7)},
-    {"E_fn", (1 << 8)},
-    {"O_fn", (1 << 9)}
-    });  // Add new flags from here
-
-bool getNextLine(std::ifstream& f, vector<string>& algWords,
-    vector<string>& truthWords, uint64_t& lineIdx, size_t& pos) {
-  string line;
-
+const double CONFIDENCE_Z = 1.959964;
+const uint64_t APPROX_SEED = 20190401;
+const uint64_t APPROX_BLOCK_SIZE = 1 << 20;
+const uint64_t MIN_APPROX_BLOCKS = 30;
+const size_t BATCH_SIZE = 65536;
+
+/*
+ * Read the next line of f into line and split it into tokens pointing into
+ * line. pos is the byte offset of the line.
+ */
+bool getNextLine(LineReader& f, string& line, vector<Token>& algTokens,
+    vector<Token>& truthTokens, uint64_t& lineIdx, size_t& pos) {
   pos = f.tellg();
-  if (!std::getline(f, line)) {
+  if (!f.getline(line)) {
     return false;
   }
 
-  vector<string> lineFields = tokenlize(line, '\t');
-  lineIdx = stoull(lineFields[0]);
-  tokenlize(lineFields[1], ' ', truthWords);
-  tokenlize(lineFields[2], ' ', algWords);
+  parseResultLine(line, lineIdx, truthTokens, algTokens);
   return true;
 }
 
-string getBIOES(const string& word, const string& nextWord,
-    vector<string>& wordFields, vector<string>& nextWordFields) {
-  tokenlize(word, '\\', wordFields);
-  string BIOES = wordFields.size() < 3 ? "O" : wordFields[2];
-  tokenlize(nextWord, '\\', nextWordFields);
-  string nextBIOES = nextWordFields.size() < 3 ? "O" : nextWordFields[2];
-
-  if (BIOES == "O") {
-    return BIOES;
-  }
-
-  if (BIOES == "I") {
-    return nextBIOES == "I" ? "I" : "E";
+void writeDetails(std::ostream& fNerNed, std::ostream& fNer,
+    const uint64_t lineIdx, const size_t linePos, const int nerNed,
+    const unsigned int flags) {
+  if (nerNed != NERNED_MISMATCH) {
+    fNer << lineIdx << "\t" << linePos << "\t" << flags << "\n";
   }
-
-  return nextBIOES == "I" ? "B" : "S";
+  fNerNed << lineIdx << "\t" << linePos << "\t" << nerNed << "\n";
 }
 
-inline double computeF1(const uint64_t& tp,
-    const uint64_t& fp, const uint64_t& fn) {
-  if (tp == 0 && fp == 0 && fn == 0) {
-    return 1.0;
-  }
-
-  if (tp == 0) {
-    return 0.0;
-  }
-
-  double p = static_cast<double>(tp) / (tp + fp);
-  double r = static_cast<double>(tp) / (tp + fn);
-  return p * r * 2 / (p + r);
-}
+struct EvalOptions {
+  size_t bootstrapSamples;
+  size_t topK;
+  bool align;
+  // Write the detail files as framed files, see frames.hpp.
+  bool compress;
+  // Write sentence_counts, for a later --paired against this result.
+  bool keepCounts;
+  string pairedCountsFile;
+  // Only lines starting in [beginOffset, endOffset) are evaluated.
+  uint64_t beginOffset;
+  uint64_t endOffset;
+  // Added to all byte offsets in the detail files, for inputs which are
+  // a split off part of a larger file.
+  uint64_t baseOffset;
+  // Recorded as alg_filename, for the web interface to find the file.
+  string algName;
+};
 
 void evaluate(const string& algFile, const string& benchmarkType,
-    const string& statFile, const string& NerNedFile, const string& NerFile) {
-  std::ifstream fAlg(algFile.c_str());
+    const string& statFile, const string& NerNedFile, const string& NerFile,
+    const string& countsFile, const string& histogramFile,
+    const string& partialFile, const string& miningFile,
+    const EvalOptions& options) {
+  LineReader fAlg(algFile);
   std::ofstream fStat(statFile.c_str());
-  std::ofstream fNerNed(NerNedFile.c_str());
-  std::ofstream fNer(NerFile.c_str());
-
-  uint64_t lineIdx;
-  size_t linePos;
-  vector<string> algWords;
-  vector<string> truthWords;
-  vector<string> wordFields;
-  vector<string> nextWordFields;
-
-  unsigned int flags = 0;
-
-  std::unordered_map<string, std::unordered_map<string, int>> statsBIOES;
-  statsBIOES["B"] = {{"tp", 0}, {"fp", 0}, {"fn", 0}};
-  statsBIOES["I"] = {{"tp", 0}, {"fp", 0}, {"fn", 0}};
-  statsBIOES["O"] = {{"tp", 0}, {"fp", 0}, {"fn", 0}};
-  statsBIOES["E"] = {{"tp", 0}, {"fp", 0}, {"fn", 0}};
-  statsBIOES["S"] = {{"tp", 0}, {"fp", 0}, {"fn", 0}};
-
-  std::unordered_map<string, uint64_t> statsSentence({
-      {"num_total", 0},
-      {"num_correct", 0},
-      {"num_wrong", 0},
-      {"num_mismatch", 0},
-      });
-
-  uint64_t microTp = 0;
-  uint64_t microFp = 0;
-  uint64_t microFn = 0;
-  double microF1InKB = 0.0;
-  double macroF1InKB = 0.0;
+  std::unique_ptr<std::ostream> fNerNed = openOutput(NerNedFile,
+      options.compress);
+  std::unique_ptr<std::ostream> fNer = openOutput(NerFile, options.compress);
+  // At 16 bytes per sentence, the counts are only kept if needed.
+  bool keepCounts = options.keepCounts || !options.pairedCountsFile.empty();
+  std::ofstream fCounts;
+  if (keepCounts) {
+    fCounts.open(countsFile.c_str(), std::ios::binary);
+  } else {
+    unlink(countsFile.c_str());
+  }
+  std::ofstream fPartial(partialFile.c_str());
+
+  // Lines are parsed, scored and written in batches, see trace.hpp.
+  vector<string> lines(BATCH_SIZE);
+  vector<uint64_t> lineIdxs(BATCH_SIZE);
+  vector<size_t> linePoss(BATCH_SIZE);
+  vector<vector<Token>> algTokens(BATCH_SIZE);
+  vector<vector<Token>> truthTokens(BATCH_SIZE);
+  vector<SentenceResult> results(BATCH_SIZE);
+  size_t batchSize = BATCH_SIZE;
+
+  EvaluatorOptions evaluatorOptions;
+  evaluatorOptions.align = options.align;
+  evaluatorOptions.topK = options.topK;
+  Evaluator evaluator(evaluatorOptions);
 
   auto time1 = std::chrono::high_resolution_clock::now();
 
-  while (getNextLine(fAlg, algWords, truthWords, lineIdx, linePos)) {
-    uint64_t macroTp = 0;
-    uint64_t macroFp = 0;
-    uint64_t macroFn = 0;
-
-    flags = 0;
-    statsSentence["num_total"]++;
-
-    if (algWords.size() != truthWords.size()) {
-      fNerNed << lineIdx << "\t" << linePos << "\t" << NERNED_MISMATCH << "\n";
-      statsSentence["num_mismatch"]++;
-      continue;
-    }
+  // Skip the line started before our range. Nothing after our range is
+  // read ahead, except for the last line.
+  if (options.beginOffset > 0) {
+    string line;
+    fAlg.seekg(options.beginOffset - 1, options.endOffset);
+    fAlg.getline(line);
+  } else {
+    fAlg.seekg(0, options.endOffset);
+  }
 
-    // Add dummy tail
-    algWords.push_back("du\\mm\\y");
-    truthWords.push_back("du\\mm\\y");
-
-    bool sentenceCorrect = true;
-    std::tuple<int, int, string> truthEntity(0, 0, "");
-    std::tuple<int, int, string> algEntity(0, 0, "");
-    vector<std::tuple<int, int, string>> truths;
-    vector<std::tuple<int, int, string>> algs;
-
-    // For each word in the sentence
-    for (size_t i = 0; i < algWords.size() - 1; i++) {
-      string algBIOES = getBIOES(algWords[i], algWords[i+1],
-          wordFields, nextWordFields);
-      string truthBIOES = getBIOES(truthWords[i], truthWords[i+1],
-          wordFields, nextWordFields);
-      string algId = tokenlize(algWords[i], '\\')[2];
-      string truthId = tokenlize(truthWords[i], '\\')[2];
-
-      // update NER stats
-      if (algBIOES == truthBIOES) {
-        statsBIOES[algBIOES]["tp"] += 1;
-      } else {
-        statsBIOES[algBIOES]["fp"] += 1;
-        statsBIOES[truthBIOES]["fn"] += 1;
-        flags |= flagBitMap[string(algBIOES + "_fp")];
-        flags |= flagBitMap[string(truthBIOES + "_fn")];
+  while (batchSize == BATCH_SIZE) {
+    {
+      TRACE_SPAN("parse_batch");
+      for (batchSize = 0; batchSize < BATCH_SIZE; batchSize++) {
+        size_t i = batchSize;
+        if (!getNextLine(fAlg, lines[i], algTokens[i], truthTokens[i],
+              lineIdxs[i], linePoss[i]) || linePoss[i] >= options.endOffset) {
+          break;
+        }
       }
+    }
 
-      // update NER_NED stats
-      if (truthBIOES == "B" || truthBIOES == "S") {
-        std::get<0>(truthEntity) = i;
-        std::get<2>(truthEntity) = truthId;
+    {
+      TRACE_SPAN("score_batch");
+      for (size_t i = 0; i < batchSize; i++) {
+        results[i] = evaluator.add(truthTokens[i], algTokens[i]);
+        results[i].counts.lineIdx = lineIdxs[i];
       }
+    }
 
-      if (truthBIOES == "E" || truthBIOES == "S") {
-        std::get<1>(truthEntity) = i;
-        truths.push_back(truthEntity);
+    {
+      TRACE_SPAN("write_batch");
+      for (size_t i = 0; i < batchSize; i++) {
+        writeDetails(*fNerNed, *fNer, lineIdxs[i],
+            linePoss[i] + options.baseOffset, results[i].nerNed,
+            results[i].flags);
+        if (keepCounts) {
+          writeSentenceCounts(fCounts, results[i].counts);
+        }
       }
+    }
+  }
 
-      if (algBIOES == "B" || algBIOES == "S") {
-        std::get<0>(algEntity) = i;
-        std::get<2>(algEntity) = algId;
-      }
+  auto time2 = std::chrono::high_resolution_clock::now();
 
-      if (algBIOES == "E" || algBIOES == "S") {
-        std::get<1>(algEntity) = i;
-        algs.push_back(algEntity);
-      }
+  // The confidence intervals come from the histogram of the Evaluator, only
+  // the paired test reads back the sentence_counts files.
+  EvalSnapshot snapshot;
+  fCounts.close();
+  string bootstrap;
+  {
+    TRACE_SPAN("bootstrap");
+    snapshot = evaluator.snapshot(options.bootstrapSamples);
+    if (options.bootstrapSamples > 0) {
+      bootstrap = bootstrapCIStats(options.bootstrapSamples,
+          snapshot.microCI, snapshot.macroCI);
+    }
+    if (!options.pairedCountsFile.empty()) {
+      bootstrap += pairedBootstrapStats(countsFile, options.pairedCountsFile,
+          options.bootstrapSamples);
     }
+  }
+  const EvalStats& stats = snapshot.stats;
+  auto time3 = std::chrono::high_resolution_clock::now();
+
+  string algFilename = benchmarkType + "/" + options.algName;
+  writeStat(fStat, stats, getSeconds(time1, time2), getSeconds(time2, time3),
+      algFilename, getFileSize(*fNerNed), getFileSize(*fNer), bootstrap);
+
+  // The end of a pipe is only known now.
+  EvalPartial partial = {stats, algFilename,
+    options.beginOffset + options.baseOffset,
+    std::min(options.endOffset, fAlg.tellg()) + options.baseOffset,
+    getSeconds(time1, time2)};
+  writePartial(fPartial, partial);
+
+  // The sketches themselves go next to the partial, for merge_stats_main.
+  ErrorMining mining = snapshot.mining ? *snapshot.mining : ErrorMining(0);
+  std::ofstream fMining(miningFile.c_str());
+  writeErrorMining(fMining, mining);
+  fMining.close();
+  std::ofstream fSketches((miningFile + "_sketches").c_str(),
+      std::ios::binary);
+  mining.write(fSketches);
+  fSketches.close();
+  std::ofstream fHistogram(histogramFile.c_str(), std::ios::binary);
+  evaluator.bootstrap().write(fHistogram);
+  fHistogram.close();
 
-    fNer << lineIdx << "\t" << linePos << "\t" << flags << "\n";
+  fAlg.close();
+  fStat.close();
+  fNerNed.reset();
+  fNer.reset();
+  fPartial.close();
+}
 
-    size_t j = 0;
-    for (auto e : algs) {
-      int head = std::get<0>(e);
-      int tail = std::get<1>(e);
-      string id = std::get<2>(e);
-      bool inKB = id.substr(0, 1) == "Q";
+/*
+ * Estimate of a total over all blocks from a simple random sample of blocks
+ * (expansion estimator).
+ */
+class TotalEstimate {
+ public:
+  TotalEstimate() : _sum(0.0), _sumSq(0.0), _n(0) {}
+
+  void add(double y) {
+    _sum += y;
+    _sumSq += y * y;
+    _n++;
+  }
 
-      if (!inKB) {
-        continue;
-      }
+  double estimate(uint64_t totalBlocks) const {
+    return _n == 0 ? 0.0 : _sum * totalBlocks / _n;
+  }
 
-      if (truths.size() == 0) {
-        macroFp++;
-        sentenceCorrect = false;
-        continue;
-      }
+  // Half width of the confidence interval, with finite population
+  // correction for sampling without replacement.
+  double error(uint64_t totalBlocks) const {
+    if (_n < 2) {
+      return 0.0;
+    }
+    double mean = _sum / _n;
+    double variance = (_sumSq - _n * mean * mean) / (_n - 1);
+    double fpc = 1.0 - static_cast<double>(_n) / totalBlocks;
+    return CONFIDENCE_Z * totalBlocks *
+      std::sqrt(std::max(0.0, variance) * fpc / _n);
+  }
 
-      // forward truths to an overlap with algs
-      while (std::get<1>(truths[j]) < head && j < truths.size() - 1) {
-        j++;
-      }
+ private:
+  double _sum;
+  double _sumSq;
+  uint64_t _n;
+};
+
+/*
+ * Estimate of a ratio sum(y) / sum(x) over all blocks from a simple random
+ * sample of blocks (ratio estimator with linearized variance).
+ */
+class RatioEstimate {
+ public:
+  RatioEstimate() : _y(0.0), _x(0.0), _yy(0.0), _xx(0.0), _xy(0.0), _n(0) {}
+
+  void add(double y, double x) {
+    _y += y;
+    _x += x;
+    _yy += y * y;
+    _xx += x * x;
+    _xy += x * y;
+    _n++;
+  }
 
-      if (std::get<0>(truths[j]) == head &&
-          std::get<1>(truths[j]) == tail &&
-          std::get<2>(truths[j]) == id) {
-        macroTp++;
-      } else if (std::get<0>(truths[j]) <= head &&
-          std::get<1>(truths[j]) >= tail &&
-          std::get<2>(truths[j]).substr(0, 1) != "Q") {
-        // outKB
-      } else {
-        macroFp++;
-        sentenceCorrect = false;
-      }
+  double ratio(double empty) const {
+    return _x == 0 ? empty : _y / _x;
+  }
+
+  double error(uint64_t totalBlocks) const {
+    if (_n < 2 || _x == 0) {
+      return 0.0;
     }
+    double r = _y / _x;
+    double meanX = _x / _n;
+    double residualSq = _yy - 2 * r * _xy + r * r * _xx;
+    double variance = residualSq / (_n - 1);
+    double fpc = 1.0 - static_cast<double>(_n) / totalBlocks;
+    return CONFIDENCE_Z *
+      std::sqrt(std::max(0.0, variance) * fpc / _n) / meanX;
+  }
 
-    // update recall counts: fn
-    j = 0;
-    int debug = 0;
-    for (auto e : truths) {
-      int head = std::get<0>(e);
-      int tail = std::get<1>(e);
-      string id = std::get<2>(e);
-      bool inKB = id.substr(0, 1) == "Q";
-
-      if (!inKB) {
-        continue;
-      }
+ private:
+  double _y;
+  double _x;
+  double _yy;
+  double _xx;
+  double _xy;
+  uint64_t _n;
+};
+
+string printEstimate(const string& key, double value, double error) {
+  return printStat(key, to_string(value)) +
+    printStat(key + "_ci_low", to_string(value - error)) +
+    printStat(key + "_ci_high", to_string(value + error));
+}
 
-      if (algs.size() == 0) {
-        macroFn++;
-        sentenceCorrect = false;
-        continue;
-      }
+string printCountEstimate(const string& key, double value, double error) {
+  auto count = [](double v) {
+    return to_string(std::llround(std::max(0.0, v)));
+  };
+  return printStat(key, count(value)) +
+    printStat(key + "_ci_low", count(value - error)) +
+    printStat(key + "_ci_high", count(value + error));
+}
 
-      // forward algs to an overlap with truths
-      while (std::get<1>(algs[j]) < head && j < algs.size() - 1) {
-        j++;
-      }
+/*
+ * Approximate evaluation on a random subset of the algorithm output.
+ *
+ * The file is cut into blocks of blockSize bytes, each line belonging to
+ * the block its first byte is in. Blocks are evaluated in random order until
+ * the confidence intervals of micro and macro F1 are both narrower than
+ * +- precision. Counts in the stat file are extrapolated to the whole file
+ * and come with confidence intervals; detail files only list the sampled
+ * sentences.
+ */
+void evaluateApprox(const string& algFile, const string& benchmarkType,
+    const string& statFile, const string& NerNedFile, const string& NerFile,
+    const double precision, const uint64_t blockSize,
+    const EvalOptions& options) {
+  LineReader fAlg(algFile);
+  std::ofstream fStat(statFile.c_str());
+  std::unique_ptr<std::ostream> fNerNed = openOutput(NerNedFile,
+      options.compress);
+  std::unique_ptr<std::ostream> fNer = openOutput(NerFile, options.compress);
 
-      if (std::get<0>(algs[j]) == head &&
-          std::get<1>(algs[j]) == tail &&
-          std::get<2>(algs[j]) == id) {
-        debug++;
-      } else {
-        macroFn++;
-        sentenceCorrect = false;
-      }
-    }
+  uint64_t lineIdx;
+  size_t linePos;
+  string line;
+  vector<Token> algTokens;
+  vector<Token> truthTokens;
+  EvaluatorOptions evaluatorOptions;
+  evaluatorOptions.align = options.align;
+  EvalStats stats;
+
+  uint64_t fileSize = fAlg.size();
+  uint64_t totalBlocks = fileSize / blockSize + 1;
+  vector<uint64_t> blocks(totalBlocks);
+  for (uint64_t b = 0; b < totalBlocks; b++) {
+    blocks[b] = b;
+  }
+  std::mt19937_64 rng(APPROX_SEED);
+  std::shuffle(blocks.begin(), blocks.end(), rng);
 
-    if (sentenceCorrect) {
-      statsSentence["num_correct"]++;
-      fNerNed << lineIdx << "\t" << linePos << "\t" << NERNED_CORRECT << "\n";
+  RatioEstimate microEstimate;
+  RatioEstimate macroEstimate;
+  std::unordered_map<string, TotalEstimate> countEstimates;
+  uint64_t sampledBlocks = 0;
+
+  auto time1 = std::chrono::high_resolution_clock::now();
+
+  for (uint64_t b : blocks) {
+    TRACE_SPAN("approx_block");
+    Evaluator blockEvaluator(evaluatorOptions);
+    uint64_t begin = b * blockSize;
+    uint64_t end = begin + blockSize;
+
+    // Skip the line started in the previous block.
+    if (begin > 0) {
+      fAlg.seekg(begin - 1, end);
+      fAlg.getline(line);
     } else {
-      statsSentence["num_wrong"]++;
-      fNerNed << lineIdx << "\t" << linePos << "\t" << NERNED_WRONG << "\n";
+      fAlg.seekg(0, end);
     }
 
-    microTp += macroTp;
-    microFp += macroFp;
-    microFn += macroFn;
+    while (fAlg.tellg() < end &&
+        getNextLine(fAlg, line, algTokens, truthTokens, lineIdx, linePos)) {
+      SentenceResult result = blockEvaluator.add(truthTokens, algTokens);
+      writeDetails(*fNerNed, *fNer, lineIdx, linePos, result.nerNed,
+          result.flags);
+    }
 
-    macroF1InKB += computeF1(macroTp, macroFp, macroFn);
+    EvalStats blockStats = blockEvaluator.snapshot().stats;
+
+    microEstimate.add(2.0 * blockStats.microTp, 2.0 * blockStats.microTp +
+        blockStats.microFp + blockStats.microFn);
+    macroEstimate.add(blockStats.macroF1Sum.value(),
+        blockStats.statsSentence["num_total"] -
+        blockStats.statsSentence["num_mismatch"]);
+    countEstimates["micro_Tp"].add(blockStats.microTp);
+    countEstimates["micro_Fp"].add(blockStats.microFp);
+    countEstimates["micro_Fn"].add(blockStats.microFn);
+    for (const auto& elem : blockStats.statsSentence) {
+      countEstimates[elem.first].add(elem.second);
+    }
+    for (const auto& elem : blockStats.statsBIOES) {
+      for (const auto& elem2 : elem.second) {
+        countEstimates[elem.first + "_" + elem2.first].add(elem2.second);
+      }
+    }
+    stats.add(blockStats);
+    sampledBlocks++;
+
+    double microError = microEstimate.error(totalBlocks);
+    double macroError = macroEstimate.error(totalBlocks);
+    printf("Sampled %lu/%lu blocks, micro F1 %.4f +- %.4f, "
+        "macro F1 %.4f +- %.4f\r", sampledBlocks, totalBlocks,
+        microEstimate.ratio(1.0), microError,
+        macroEstimate.ratio(0.0), macroError);
+    fflush(stdout);
+
+    if (sampledBlocks >= MIN_APPROX_BLOCKS &&
+        microError <= precision && macroError <= precision) {
+      break;
+    }
   }
 
-  microF1InKB = computeF1(microTp, microFp, microFn);
-  macroF1InKB /= (statsSentence["num_total"] - statsSentence["num_mismatch"]);
-
   auto time2 = std::chrono::high_resolution_clock::now();
 
   fStat << "{\n";
 
   fStat << printStat("duration", getDuration(time1, time2));
-  fStat << printStat(
-      "alg_filename", benchmarkType + "/" + getFileName(algFile));
-  fStat << printStat("filesize_ner_ned", getFileSize(fNerNed));
-  fStat << printStat("filesize_ner", getFileSize(fNer));
-  fStat << printStat("micro_F1_InKB", to_string(microF1InKB));
-  fStat << printStat("macro_F1_InKB", to_string(macroF1InKB));
-  fStat << printStat("micro_Tp", to_string(microTp));
-  fStat << printStat("micro_Fp", to_string(microFp));
-  fStat << printStat("micro_Fn", to_string(microFn));
-
-  for (const auto& elem : statsSentence) {
-    fStat << printStat(elem.first, to_string(elem.second));
-  }
-
-  for (const auto& elem : statsBIOES) {
-    string key = elem.first + "_";
-    for (const auto& elem2 : elem.second) {
-      fStat << printStat(key + elem2.first, to_string(elem2.second));
-    }
+  fStat << printStat("alg_filename", benchmarkType + "/" + options.algName);
+  fStat << printStat("filesize_ner_ned", getFileSize(*fNerNed));
+  fStat << printStat("filesize_ner", getFileSize(*fNer));
+  fStat << printStat("approximate", "true");
+  fStat << printStat("approx_precision", to_string(precision));
+  fStat << printStat("confidence_level", to_string(CONFIDENCE_LEVEL));
+  fStat << printStat("sampled_blocks", to_string(sampledBlocks));
+  fStat << printStat("total_blocks", to_string(totalBlocks));
+  fStat << printStat("sampled_num_total",
+      to_string(stats.statsSentence["num_total"]));
+  fStat << printEstimate("micro_F1_InKB", microEstimate.ratio(1.0),
+      microEstimate.error(totalBlocks));
+  fStat << printEstimate("macro_F1_InKB", macroEstimate.ratio(0.0),
+      macroEstimate.error(totalBlocks));
+  for (const auto& elem : countEstimates) {
+    fStat << printCountEstimate(elem.first, elem.second.estimate(totalBlocks),
+        elem.second.error(totalBlocks));
   }
-
   fStat << "  \"dummy\": \"tail\"\n}\n";
 
   fAlg.close();
   fStat.close();
-  fNerNed.close();
-  fNer.close();
+  fNerNed.reset();
+  fNer.reset();
 }
 
 int main(int argc, char** argv) {
-  if (argc < 3) {
+  startTrace(argc, argv);
+  vector<string> args = getPositionalArgs(argc, argv, {"--bootstrap",
+      "--paired", "--approx", "--approx-block-size", "--top-k", "--shard",
+      "--base-offset", "--benchmark", "--out", "--name", "--trace", "--io"});
+  string outOption = getOption(argc, argv, "--out", "");
+  if (args.empty() || (args.size() < 2 && outOption.empty())) {
     cout << "\nUsage: \n" <<
-      "  evaluate_main <algorithm_iob_file> <eval_results_dir>\n\n";
+      "  evaluate_main <algorithm_iob_file> <eval_results_dir> " <<
+      "[ --bootstrap <n> ] [ --paired <other_result_dir> ]\n" <<
+      "    [ --approx <precision> ] [ --approx-block-size <bytes> ]\n" <<
+      "    [ --align ] [ --top-k <k> ] [ --compress ] [ --keep-counts ]\n" <<
+      "    [ --shard <i>/<n> ] [ --base-offset <bytes> ]" <<
+      " [ --trace <trace.json> ]\n" <<
+      "    [ --io <auto|uring|threads> ]\n" <<
+      "  evaluate_main - --benchmark <type> --out <result_dir> " <<
+      "--name <alg_file_name> [ ... ]\n" <<
+      "\nOptions: \n" <<
+      "  <algorithm_iob_file>\n" <<
+      "    Plain or compressed by a generator with --compress.\n" <<
+      "    \"-\" or a pipe to evaluate the output of an algorithm while " <<
+      "it is written.\n" <<
+      "    Needs --benchmark, --out and --name, not possible with " <<
+      "--approx and --shard.\n\n" <<
+      "  --benchmark <type>\n" <<
+      "    clueweb, manual, conll or others. Default: found in the file " <<
+      "name.\n\n" <<
+      "  --out <result_dir>\n" <<
+      "    Result folder. Default: <eval_results_dir>/<type>-<algorithm> " <<
+      "from the file name.\n\n" <<
+      "  --name <alg_file_name>\n" <<
+      "    File name recorded in the stat file. Default: the name of " <<
+      "<algorithm_iob_file>. Needed for a pipe.\n\n" <<
+      "  --bootstrap <n>\n" <<
+      "    Number of bootstrap resamples for the confidence intervals of " <<
+      "micro and macro F1. Default 0, i.e. none.\n\n" <<
+      "  --keep-counts\n" <<
+      "    Write the per-sentence counts to sentence_counts (16 bytes " <<
+      "per sentence), for a later --paired against this result.\n\n" <<
+      "  --paired <other_result_dir>\n" <<
+      "    Result folder of another algorithm on the same ground truth, " <<
+      "with --keep-counts. Run a paired bootstrap test against it.\n" <<
+      "    Needs --bootstrap and keeps the sentence_counts of this " <<
+      "result.\n\n" <<
+      "  --approx <precision>\n" <<
+      "    Only evaluate random blocks of the file until the confidence " <<
+      "intervals of micro and macro F1 are within +- <precision>.\n" <<
+      "    All counts in the stat file are then estimates.\n\n" <<
+      "  --approx-block-size <bytes>\n" <<
+      "    Size of the sampled blocks. Default " << APPROX_BLOCK_SIZE <<
+      ".\n\n" <<
+      "  --align\n" <<
+      "    Align sentences whose algorithm and truth token counts differ " <<
+      "by their words instead of skipping them as mismatched.\n" <<
+      "    Counted as num_aligned.\n\n" <<
+      "  --top-k <k>\n" <<
+      "    Number of most frequent false positive ids, false negative ids " <<
+      "and confusions listed in error_mining. Default " << TOP_K <<
+      ".\n\n" <<
+      "  --compress\n" <<
+      "    Write detail_ner.gz and detail_ner_ned.gz, compressed in " <<
+      "seekable frames (see frames.hpp).\n\n" <<
+      "  --shard <i>/<n>\n" <<
+      "    Only evaluate the lines starting in the i-th of n equal byte " <<
+      "ranges of the file (0-based).\n" <<
+      "    Combine the results of all shards with merge_stats_main.\n\n" <<
+      "  --base-offset <bytes>\n" <<
+      "    Byte offset of <algorithm_iob_file> in the complete output, " <<
+      "if it is a split off part of it.\n\n" <<
+      TRACE_USAGE <<
+      IO_USAGE;
+    return 1;
+  }
+
+  string algFile = args[0];
+  setReadBackend(argc, argv);
+  bool seekable = !isPipe(algFile);
+  uint64_t fileSize = UINT64_MAX;
+  if (seekable) {
+    LineReader fAlg(algFile);
+    fileSize = fAlg.size();
+  }
+
+  string benchmarkType = getOption(argc, argv, "--benchmark", "");
+  if (!seekable && (benchmarkType.empty() || outOption.empty() ||
+        !hasOption(argc, argv, "--name"))) {
+    cout << "Reading from a pipe needs --benchmark, --out and --name\n";
+    return 1;
+  }
+  if (!seekable && (hasOption(argc, argv, "--approx") ||
+        hasOption(argc, argv, "--shard"))) {
+    cout << "--approx and --shard need a seekable file\n";
     return 1;
   }
 
-  vector<string> types = {"clueweb", "manual", "conll"};
-  string benchmarkType = "others";
-  for (auto type : types) {
-      std::size_t pos = string(argv[1]).find(type);
+  if (benchmarkType.empty()) {
+    vector<string> types = {"clueweb", "manual", "conll"};
+    benchmarkType = "others";
+    for (auto type : types) {
+      std::size_t pos = algFile.find(type);
       if (pos != string::npos) {
-          benchmarkType = type;
-          break;
+        benchmarkType = type;
+        break;
       }
+    }
   }
 
-  string outputDir = string(argv[2]) + "/" + benchmarkType;
+  string outputDir = outOption;
+  if (outputDir.empty()) {
+    std::size_t posAlg = algFile.find("alg");
+    if (posAlg == string::npos) {
+      cout << "No \"alg\" in the file name, pass the result folder with " <<
+        "--out\n";
+      return 1;
+    }
+    outputDir = args[1] + "/" + benchmarkType;
+    vector<string> fields = tokenlize(algFile.substr(posAlg), '.');
+    outputDir += "-" + fields[0].substr(4);
+    if (fields.size() > 1) {
+      outputDir += "-" + fields[1];
+    }
+  }
 
-  std::size_t posAlg = string(argv[1]).find("alg");
-  vector<string> fields = tokenlize(string(argv[1]).substr(posAlg), '.');
-  outputDir += "-" + fields[0].substr(4);
-  if (fields.size() > 1) {
-    outputDir += "-" + fields[1];
+  EvalOptions options;
+  options.beginOffset = 0;
+  options.endOffset = fileSize;
+  options.baseOffset = getCountOption(argc, argv, "--base-offset", 0);
+  options.algName = getOption(argc, argv, "--name", getFileName(algFile));
+
+  string shard = getOption(argc, argv, "--shard", "");
+  if (!shard.empty()) {
+    vector<string> shardFields = tokenlize(shard, '/');
+    if (shardFields.size() != 2) {
+      cout << "Invalid value \"" << shard << "\" for --shard\n";
+      return 1;
+    }
+    uint64_t shardIdx = parseCount(shardFields[0], "--shard");
+    uint64_t numShards = parseCount(shardFields[1], "--shard");
+    if (shardIdx >= numShards) {
+      cout << "Invalid value \"" << shard << "\" for --shard\n";
+      return 1;
+    }
+    options.beginOffset = fileSize * shardIdx / numShards;
+    options.endOffset = fileSize * (shardIdx + 1) / numShards;
+    outputDir += "-shard" + shardFields[0] + "of" + shardFields[1];
   }
 
   if (mkdir(outputDir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1) {
@@ -338,12 +581,44 @@ int main(int argc, char** argv) {
   }
 
   string statFilepath = outputDir + "/stat";
-  string NerNedFilepath = outputDir + "/detail_ner_ned";
-  string NerFilepath = outputDir + "/detail_ner";
+  options.compress = hasOption(argc, argv, "--compress");
+  string detailSuffix = options.compress ? FRAME_SUFFIX : "";
+  string NerNedFilepath = outputDir + "/detail_ner_ned" + detailSuffix;
+  string NerFilepath = outputDir + "/detail_ner" + detailSuffix;
+  string countsFilepath = outputDir + "/sentence_counts";
+  string histogramFilepath = outputDir + "/bootstrap_histogram";
+  string partialFilepath = outputDir + "/partial";
+  string miningFilepath = outputDir + "/error_mining";
+  string pairedDir = getOption(argc, argv, "--paired", "");
+  options.pairedCountsFile = pairedDir.empty() ? "" :
+    pairedDir + "/sentence_counts";
+  options.align = hasOption(argc, argv, "--align");
+  options.keepCounts = hasOption(argc, argv, "--keep-counts");
+  options.topK = getCountOption(argc, argv, "--top-k", TOP_K);
+  options.bootstrapSamples = getCountOption(argc, argv, "--bootstrap", 0);
+  if (!checkPaired(options.pairedCountsFile, options.bootstrapSamples)) {
+    return 1;
+  }
   cout << "\nOutput path:\n" << statFilepath << "\n" << NerNedFilepath << "\n"
     << NerFilepath << "\n";
-  evaluate(argv[1], benchmarkType, statFilepath, NerNedFilepath, NerFilepath);
+
+  if (hasOption(argc, argv, "--approx")) {
+    string approx = getOption(argc, argv, "--approx", "0.001");
+    char* end;
+    double precision = strtod(approx.c_str(), &end);
+    if (approx.empty() || *end != '\0' || !(precision > 0)) {
+      cout << "Invalid value \"" << approx << "\" for --approx\n";
+      return 1;
+    }
+    uint64_t blockSize = getCountOption(argc, argv, "--approx-block-size",
+        APPROX_BLOCK_SIZE, 1);
+    evaluateApprox(algFile, benchmarkType, statFilepath, NerNedFilepath,
+        NerFilepath, precision, blockSize, options);
+  } else {
+    evaluate(algFile, benchmarkType, statFilepath, NerNedFilepath,
+        NerFilepath, countsFilepath, histogramFilepath, partialFilepath,
+        miningFilepath, options);
+  }
   cout << "\nDone!\n\n";
   return 0;
 }
-
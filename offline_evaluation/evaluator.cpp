@@ -0,0 +1,363 @@
+// Copyright 2020, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Yi-Chun Lin <circle40191@gmail.com>
+
+#include "evaluator.h"
+#include <cstdlib>
+#include "align.hpp"
+
+namespace {
+
+enum { TP, FP, FN };
+
+const char* TAG_NAMES[NUM_TAGS] = {"S", "B", "I", "E", "O"};
+
+uint64_t isLabel(const StrView& label, const char c) {
+  return label.size == 1 && label.data[0] == c;
+}
+
+bool isInKB(const StrView& id) {
+  return id.size > 0 && id.data[0] == 'Q';
+}
+
+/*
+ * Encode the NER tags of a sentence as bitmasks of 64 tokens per word: bit
+ * i % 64 of masks[t * numWords + i / 64] is set if token i has tag t.
+ *
+ * The tag of a token depends on whether the next token is an I: an I is
+ * followed by an I (I) or not (E), any other label except O starts an entity
+ * which goes on (B) or not (S).
+ */
+void encodeTags(const Token* tokens, const size_t numTokens,
+    const size_t numWords, uint64_t* masks) {
+  uint64_t* tagS = masks + TAG_S * numWords;
+  uint64_t* tagB = masks + TAG_B * numWords;
+  uint64_t* tagI = masks + TAG_I * numWords;
+  uint64_t* tagE = masks + TAG_E * numWords;
+  uint64_t* tagO = masks + TAG_O * numWords;
+  memset(masks, 0, NUM_TAGS * numWords * sizeof(uint64_t));
+
+  // The labels O and I go to the O and I masks first.
+  for (size_t i = 0; i < numTokens; i++) {
+    const StrView& label = tokens[i].label;
+    tagO[i / 64] |= isLabel(label, 'O') << (i % 64);
+    tagI[i / 64] |= isLabel(label, 'I') << (i % 64);
+  }
+
+  for (size_t w = 0; w < numWords; w++) {
+    uint64_t valid = w + 1 < numWords || numTokens % 64 == 0 ? ~0ull :
+      (1ull << (numTokens % 64)) - 1;
+    uint64_t isI = tagI[w];
+    uint64_t isOther = valid & ~tagO[w] & ~isI;
+    uint64_t nextI = isI >> 1 | (w + 1 < numWords ? tagI[w + 1] << 63 : 0);
+    tagI[w] = isI & nextI;
+    tagE[w] = isI & ~nextI;
+    tagB[w] = isOther & nextI;
+    tagS[w] = isOther & ~nextI;
+  }
+}
+
+// Find c in [begin, end), or return end.
+const char* find(const char* begin, const char* end, const char c) {
+  const void* pos = memchr(begin, c, end - begin);
+  return pos == NULL ? end : static_cast<const char*>(pos);
+}
+
+}  // namespace
+
+Token parseToken(const StrView& word) {
+  const char* end = word.data + word.size;
+  const char* tagBegin = find(word.data, end, '\\');
+  Token token;
+  token.word = StrView(word.data, tagBegin - word.data);
+  token.label = StrView("O", 1);
+
+  // Same fields as tokenlize(word, '\\'), which drops an empty last field.
+  const char* labelBegin = tagBegin == end ? end :
+    find(tagBegin + 1, end, '\\');
+  if (labelBegin != end && labelBegin + 1 != end) {
+    const char* labelEnd = find(labelBegin + 1, end, '\\');
+    token.label = StrView(labelBegin + 1, labelEnd - labelBegin - 1);
+  }
+  return token;
+}
+
+void parseSentence(const StrView& sentence, vector<Token>& tokens) {
+  tokens.clear();
+  const char* end = sentence.data + sentence.size;
+  const char* begin = sentence.data;
+  while (begin != end) {
+    const char* wordEnd = find(begin, end, ' ');
+    tokens.push_back(parseToken(StrView(begin, wordEnd - begin)));
+    begin = wordEnd == end ? end : wordEnd + 1;
+  }
+}
+
+void parseResultLine(const string& line, uint64_t& lineIdx,
+    vector<Token>& truthTokens, vector<Token>& algTokens) {
+  const char* end = line.data() + line.size();
+  const char* truthBegin = find(line.data(), end, '\t');
+  truthBegin += truthBegin != end;
+  const char* truthEnd = find(truthBegin, end, '\t');
+  const char* algBegin = truthEnd + (truthEnd != end);
+  const char* algEnd = find(algBegin, end, '\t');
+
+  lineIdx = strtoull(line.c_str(), NULL, 10);
+  parseSentence(StrView(truthBegin, truthEnd - truthBegin), truthTokens);
+  parseSentence(StrView(algBegin, algEnd - algBegin), algTokens);
+}
+
+Evaluator::Evaluator(const EvaluatorOptions& options) : _options(options),
+  _numTotal(0), _numCorrect(0), _numWrong(0), _numMismatch(0),
+  _numAligned(0), _microTp(0), _microFp(0), _microFn(0), _bootstrap(false) {
+  memset(_tagCounts, 0, sizeof(_tagCounts));
+  if (options.topK > 0) {
+    _mining.reset(new ErrorMining(options.topK));
+  }
+}
+
+SentenceResult Evaluator::add(const Token* truth, size_t numTruth,
+    const Token* alg, size_t numAlg) {
+  SentenceResult result;
+  result.flags = 0;
+  result.counts = {0, 0, 0, 0, 0};
+  _numTotal++;
+
+  if (numAlg != numTruth) {
+    if (!_options.align || !alignTokens(truth, numTruth, alg, numAlg)) {
+      _numMismatch++;
+      result.nerNed = NERNED_MISMATCH;
+      return result;
+    }
+    alg = _alignedTokens.data();
+    numAlg = _alignedTokens.size();
+    _numAligned++;
+  }
+
+  // NER: the tags of 64 tokens are compared at once.
+  size_t numWords = (numAlg + 63) / 64;
+  _truthMasks.resize(NUM_TAGS * numWords);
+  _algMasks.resize(NUM_TAGS * numWords);
+  encodeTags(truth, numAlg, numWords, _truthMasks.data());
+  encodeTags(alg, numAlg, numWords, _algMasks.data());
+  for (int t = 0; t < NUM_TAGS; t++) {
+    const uint64_t* truthTag = _truthMasks.data() + t * numWords;
+    const uint64_t* algTag = _algMasks.data() + t * numWords;
+    uint64_t fpMask = 0;
+    uint64_t fnMask = 0;
+    for (size_t w = 0; w < numWords; w++) {
+      _tagCounts[t][TP] += __builtin_popcountll(algTag[w] & truthTag[w]);
+      _tagCounts[t][FP] += __builtin_popcountll(algTag[w] & ~truthTag[w]);
+      _tagCounts[t][FN] += __builtin_popcountll(truthTag[w] & ~algTag[w]);
+      fpMask |= algTag[w] & ~truthTag[w];
+      fnMask |= truthTag[w] & ~algTag[w];
+    }
+    result.flags |= (fpMask != 0) << t;
+    result.flags |= (fnMask != 0) << (NUM_TAGS + t);
+  }
+
+  // NER_NED
+  extractEntities(truth, _truthMasks.data(), numWords, _truths);
+  extractEntities(alg, _algMasks.data(), numWords, _algs);
+
+  uint64_t tp = 0;
+  uint64_t fp = 0;
+  uint64_t fn = 0;
+  ErrorMining* mining = _mining.get();
+
+  // Precision: each InKB alg entity against the first truth entity not
+  // ending before it.
+  size_t j = 0;
+  for (const Entity& e : _algs) {
+    if (!isInKB(e.id)) {
+      continue;
+    }
+
+    if (mining != NULL) {
+      mining->algEntities.add(e.id.str());
+    }
+
+    if (_truths.empty()) {
+      fp++;
+      if (mining != NULL) {
+        mining->falsePositives.add(e.id.str());
+        mining->falsePositiveIds.add(e.id.str());
+      }
+      continue;
+    }
+
+    while (_truths[j].tail < e.head && j < _truths.size() - 1) {
+      j++;
+    }
+
+    const Entity& t = _truths[j];
+    if (t.head == e.head && t.tail == e.tail && t.id == e.id) {
+      tp++;
+    } else if (t.head <= e.head && t.tail >= e.tail && !isInKB(t.id)) {
+      // outKB
+    } else {
+      fp++;
+      if (mining != NULL) {
+        mining->falsePositives.add(e.id.str());
+        mining->falsePositiveIds.add(e.id.str());
+        if (t.head == e.head && t.tail == e.tail && isInKB(t.id)) {
+          mining->confusions.add(t.id.str() + " " + e.id.str());
+        }
+      }
+    }
+  }
+
+  // Recall: each InKB truth entity against the first alg entity not ending
+  // before it.
+  j = 0;
+  for (const Entity& t : _truths) {
+    if (!isInKB(t.id)) {
+      continue;
+    }
+
+    if (mining != NULL) {
+      mining->truthEntities.add(t.id.str());
+    }
+
+    bool found = false;
+    if (!_algs.empty()) {
+      while (_algs[j].tail < t.head && j < _algs.size() - 1) {
+        j++;
+      }
+      const Entity& e = _algs[j];
+      found = e.head == t.head && e.tail == t.tail && e.id == t.id;
+    }
+
+    if (!found) {
+      fn++;
+      if (mining != NULL) {
+        mining->falseNegatives.add(t.id.str());
+        mining->falseNegativeIds.add(t.id.str());
+      }
+    }
+  }
+
+  bool correct = fp == 0 && fn == 0;
+  (correct ? _numCorrect : _numWrong)++;
+  _microTp += tp;
+  _microFp += fp;
+  _microFn += fn;
+  _macroF1Sum.add(computeF1(tp, fp, fn));
+
+  result.nerNed = correct ? NERNED_CORRECT : NERNED_WRONG;
+  result.counts.tp = saturate16(tp);
+  result.counts.fp = saturate16(fp);
+  result.counts.fn = saturate16(fn);
+  result.counts.scored = 1;
+  _bootstrap.add(result.counts);
+  return result;
+}
+
+void Evaluator::extractEntities(const Token* tokens, const uint64_t* masks,
+    const size_t numWords, vector<Entity>& entities) {
+  // The head and id of an entity are kept until the next B or S, so an I
+  // without a B before it closes the previous entity again.
+  Entity entity = {0, 0, StrView()};
+  entities.clear();
+  for (size_t w = 0; w < numWords; w++) {
+    uint64_t heads = masks[TAG_B * numWords + w] | masks[TAG_S * numWords + w];
+    uint64_t tails = masks[TAG_E * numWords + w] | masks[TAG_S * numWords + w];
+    for (; tails != 0; tails &= tails - 1) {
+      int bit = __builtin_ctzll(tails);
+      // The last head at or before the tail, if it is in this word.
+      uint64_t before = heads & ((2ull << bit) - 1);
+      if (before != 0) {
+        entity.head = w * 64 + 63 - __builtin_clzll(before);
+        entity.id = tokens[entity.head].label;
+      }
+      entity.tail = w * 64 + bit;
+      entities.push_back(entity);
+    }
+    if (heads != 0) {
+      entity.head = w * 64 + 63 - __builtin_clzll(heads);
+      entity.id = tokens[entity.head].label;
+    }
+  }
+}
+
+bool Evaluator::alignTokens(const Token* truth, size_t numTruth,
+    const Token* alg, size_t numAlg) {
+  // alignWords works on whole words, rebuild them from the tokens.
+  auto rebuild = [](const Token* tokens, size_t numTokens,
+      vector<string>& words) {
+    words.resize(numTokens);
+    for (size_t i = 0; i < numTokens; i++) {
+      words[i].assign(tokens[i].word.data, tokens[i].word.size);
+      words[i] += "\\?\\";
+      words[i].append(tokens[i].label.data, tokens[i].label.size);
+    }
+  };
+  rebuild(truth, numTruth, _truthWords);
+  rebuild(alg, numAlg, _algWords);
+
+  if (!alignWords(_truthWords, _algWords, _alignedWords)) {
+    return false;
+  }
+
+  _alignedTokens.resize(_alignedWords.size());
+  for (size_t i = 0; i < _alignedWords.size(); i++) {
+    _alignedTokens[i] = parseToken(StrView(_alignedWords[i]));
+  }
+  return true;
+}
+
+void Evaluator::merge(const Evaluator& other) {
+  for (int t = 0; t < NUM_TAGS; t++) {
+    for (int c = 0; c < 3; c++) {
+      _tagCounts[t][c] += other._tagCounts[t][c];
+    }
+  }
+  _numTotal += other._numTotal;
+  _numCorrect += other._numCorrect;
+  _numWrong += other._numWrong;
+  _numMismatch += other._numMismatch;
+  _numAligned += other._numAligned;
+  _microTp += other._microTp;
+  _microFp += other._microFp;
+  _microFn += other._microFn;
+  _macroF1Sum.add(other._macroF1Sum);
+  _bootstrap.add(other._bootstrap);
+  if (_mining && other._mining) {
+    _mining->add(*other._mining);
+  }
+}
+
+EvalSnapshot Evaluator::snapshot(size_t bootstrapSamples) const {
+  EvalSnapshot s;
+  for (int t = 0; t < NUM_TAGS; t++) {
+    auto& tagStats = s.stats.statsBIOES[TAG_NAMES[t]];
+    tagStats["tp"] = _tagCounts[t][TP];
+    tagStats["fp"] = _tagCounts[t][FP];
+    tagStats["fn"] = _tagCounts[t][FN];
+  }
+  s.stats.statsSentence["num_total"] = _numTotal;
+  s.stats.statsSentence["num_correct"] = _numCorrect;
+  s.stats.statsSentence["num_wrong"] = _numWrong;
+  s.stats.statsSentence["num_mismatch"] = _numMismatch;
+  s.stats.statsSentence["num_aligned"] = _numAligned;
+  s.stats.microTp = _microTp;
+  s.stats.microFp = _microFp;
+  s.stats.microFn = _microFn;
+  s.stats.macroF1Sum = _macroF1Sum;
+  s.microF1 = microF1(s.stats);
+  s.macroF1 = macroF1(s.stats);
+
+  s.bootstrapSamples = bootstrapSamples;
+  s.microCI = s.macroCI = std::make_pair(0.0, 0.0);
+  if (bootstrapSamples > 0) {
+    Bootstrap bootstrap(_bootstrap);
+    bootstrap.run(bootstrapSamples, BOOTSTRAP_SEED);
+    s.microCI = bootstrap.microCI(0, CONFIDENCE_LEVEL);
+    s.macroCI = bootstrap.macroCI(0, CONFIDENCE_LEVEL);
+  }
+
+  if (_mining) {
+    s.mining = std::make_shared<ErrorMining>(*_mining);
+  }
+  return s;
+}
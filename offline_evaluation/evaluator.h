@@ -0,0 +1,174 @@
+// Copyright 2020, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Yi-Chun Lin <circle40191@gmail.com>
+
+#pragma once
+
+#include <cstring>
+#include <memory>
+#include <utility>
+#include "bootstrap.hpp"
+#include "eval_stats.hpp"
+#include "sketches.hpp"
+#include "utils.hpp"
+
+/*
+ * Incremental NER / NER_NED scoring, usable without evaluate_main.
+ *
+ * An Evaluator scores one sentence per add() and keeps all counters of the
+ * stat file in fixed arrays. Sentences are passed as Tokens, i.e. views into
+ * the buffers of the caller, so add() copies no strings and allocates
+ * nothing once its scratch vectors have grown to the longest sentence. Only
+ * aligning sentences of different length and the error mining allocate.
+ *
+ * An Evaluator is not thread safe. To score on several threads, give each
+ * thread its own Evaluator and merge() them at the end. The counters and
+ * macro F1 do not depend on the order (see ExactSum), the error mining only
+ * within the error bounds of its sketches.
+ */
+
+#define NERNED_CORRECT 0
+#define NERNED_WRONG 1
+#define NERNED_MISMATCH 2
+
+// NER tags of a token. An fp of tag t sets bit t of the NER flags of a
+// sentence, an fn of tag t sets bit NUM_TAGS + t.
+enum NerTag { TAG_S, TAG_B, TAG_I, TAG_E, TAG_O, NUM_TAGS };
+
+/*
+ * Non-owning view of a string.
+ */
+struct StrView {
+  StrView() : data(""), size(0) {}
+  StrView(const char* data, size_t size) : data(data), size(size) {}
+  explicit StrView(const string& s) : data(s.data()), size(s.size()) {}
+
+  bool operator==(const StrView& other) const {
+    return size == other.size && memcmp(data, other.data, size) == 0;
+  }
+
+  string str() const { return string(data, size); }
+
+  const char* data;
+  size_t size;
+};
+
+/*
+ * One word WORD\TAG\LABEL of an IOB sentence. label is an entity id, "I" or
+ * "O", and "O" if the word has no label.
+ */
+struct Token {
+  StrView word;
+  StrView label;
+};
+
+// Split the word WORD\TAG\LABEL, e.g. "Obama\NNP\Q76".
+Token parseToken(const StrView& word);
+
+// Split the words of an IOB sentence into tokens.
+void parseSentence(const StrView& sentence, vector<Token>& tokens);
+
+// Split a line LINE_NO <TAB> TRUTH_LINE <TAB> ALG_LINE of an algorithm
+// result. The tokens point into line.
+void parseResultLine(const string& line, uint64_t& lineIdx,
+    vector<Token>& truthTokens, vector<Token>& algTokens);
+
+struct EvaluatorOptions {
+  EvaluatorOptions() : align(false), topK(0) {}
+
+  // Align sentences of different length instead of skipping them, see
+  // align.hpp.
+  bool align;
+  // Length of the error mining lists, 0 to disable the error mining.
+  size_t topK;
+};
+
+// The result of one sentence, as listed in the detail files.
+struct SentenceResult {
+  // NERNED_CORRECT, NERNED_WRONG or NERNED_MISMATCH.
+  int nerNed;
+  // NER flags, see NerTag. 0 if mismatched.
+  unsigned int flags;
+  // InKB counts, for the sentence_counts file. lineIdx is left to the caller.
+  SentenceCounts counts;
+};
+
+// All metrics of the sentences added so far.
+struct EvalSnapshot {
+  EvalStats stats;
+  double microF1;
+  double macroF1;
+  // Bootstrap confidence intervals at CONFIDENCE_LEVEL, (0, 0) if
+  // bootstrapSamples is 0.
+  size_t bootstrapSamples;
+  std::pair<double, double> microCI;
+  std::pair<double, double> macroCI;
+  // NULL without error mining.
+  std::shared_ptr<ErrorMining> mining;
+};
+
+class Evaluator {
+ public:
+  explicit Evaluator(const EvaluatorOptions& options = EvaluatorOptions());
+  Evaluator(const Evaluator&) = delete;
+  Evaluator& operator=(const Evaluator&) = delete;
+
+  // Score the algorithm tokens of one sentence against the truth tokens.
+  SentenceResult add(const Token* truth, size_t numTruth, const Token* alg,
+      size_t numAlg);
+
+  SentenceResult add(const vector<Token>& truth, const vector<Token>& alg) {
+    return add(truth.data(), truth.size(), alg.data(), alg.size());
+  }
+
+  // Add the counters of other, which must have the same options.
+  void merge(const Evaluator& other);
+
+  // Compute the metrics, with bootstrapSamples resamples for the confidence
+  // intervals.
+  EvalSnapshot snapshot(size_t bootstrapSamples = 0) const;
+
+  // The histogram the confidence intervals are resampled from, to be
+  // written for merge_stats_main.
+  const Bootstrap& bootstrap() const { return _bootstrap; }
+
+ private:
+  // An entity span [head, tail] and its id.
+  struct Entity {
+    size_t head;
+    size_t tail;
+    StrView id;
+  };
+
+  // The entities of a sentence from its tag masks, in the order of their
+  // tails, see encodeTags() in evaluator.cpp.
+  static void extractEntities(const Token* tokens, const uint64_t* masks,
+      size_t numWords, vector<Entity>& entities);
+
+  bool alignTokens(const Token* truth, size_t numTruth, const Token* alg,
+      size_t numAlg);
+
+  EvaluatorOptions _options;
+  uint64_t _tagCounts[NUM_TAGS][3];
+  uint64_t _numTotal;
+  uint64_t _numCorrect;
+  uint64_t _numWrong;
+  uint64_t _numMismatch;
+  uint64_t _numAligned;
+  uint64_t _microTp;
+  uint64_t _microFp;
+  uint64_t _microFn;
+  ExactSum _macroF1Sum;
+  Bootstrap _bootstrap;
+  std::unique_ptr<ErrorMining> _mining;
+
+  // Scratch space, reused by each add().
+  vector<uint64_t> _truthMasks;
+  vector<uint64_t> _algMasks;
+  vector<Entity> _truths;
+  vector<Entity> _algs;
+  vector<string> _truthWords;
+  vector<string> _algWords;
+  vector<string> _alignedWords;
+  vector<Token> _alignedTokens;
+};
@@ -0,0 +1,469 @@
+// Copyright 2020, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Yi-Chun Lin <circle40191@gmail.com>
+
+#pragma once
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include "thread_pool.hpp"
+#include "utils.hpp"
+
+/*
+ * Seekable compressed files.
+ *
+ * A FrameWriter cuts its output into frames of FRAME_SIZE bytes and
+ * compresses each frame as a gzip member of its own on background threads.
+ * The frames together are still a valid gzip file (zcat works), and
+ * <file>.idx records where each frame ends, both in the uncompressed
+ * ("logical") and in the compressed file. A FrameReader uses the index to
+ * decompress only the frame holding a logical offset, so byte offsets into
+ * the uncompressed text, like the line offsets in the detail files, stay
+ * valid.
+ *
+ * The index is FRAME_INDEX_MAGIC followed by one pair of uint64 (logical
+ * end, compressed end) per frame. It is written along with the frames, so
+ * flush() leaves a consistent file behind.
+ */
+
+const size_t FRAME_SIZE = 1 << 20;
+const int FRAME_LEVEL = 6;
+// Frames compressed but not yet written, per thread.
+const size_t FRAMES_IN_FLIGHT = 4;
+const char FRAME_SUFFIX[] = ".gz";
+const char FRAME_INDEX_SUFFIX[] = ".idx";
+const char FRAME_INDEX_MAGIC[] = "IOBFRAM1";
+const size_t FRAME_INDEX_HEADER = sizeof(FRAME_INDEX_MAGIC) - 1;
+
+struct FrameEnd {
+  uint64_t logical;
+  uint64_t compressed;
+};
+
+// Whether filename is named and indexed like the output of a FrameWriter.
+// The index may still be unreadable, see isFramed().
+inline bool hasFrameIndex(const string& filename) {
+  size_t suffixSize = strlen(FRAME_SUFFIX);
+  struct stat st;
+  return filename.size() > suffixSize &&
+    filename.compare(filename.size() - suffixSize, suffixSize,
+        FRAME_SUFFIX) == 0 &&
+    stat((filename + FRAME_INDEX_SUFFIX).c_str(), &st) == 0;
+}
+
+// Whether filename was written by a FrameWriter, i.e. has a valid index.
+inline bool isFramed(const string& filename) {
+  if (!hasFrameIndex(filename)) {
+    return false;
+  }
+  std::ifstream fIndex((filename + FRAME_INDEX_SUFFIX).c_str(),
+      std::ios::binary);
+  char magic[FRAME_INDEX_HEADER];
+  return fIndex.read(magic, sizeof(magic)) &&
+    memcmp(magic, FRAME_INDEX_MAGIC, sizeof(magic)) == 0;
+}
+
+inline bool readFrameIndex(const string& filename, vector<FrameEnd>& frames) {
+  std::ifstream fIndex((filename + FRAME_INDEX_SUFFIX).c_str(),
+      std::ios::binary);
+  char magic[FRAME_INDEX_HEADER];
+  if (!fIndex.read(magic, sizeof(magic)) ||
+      memcmp(magic, FRAME_INDEX_MAGIC, sizeof(magic)) != 0) {
+    return false;
+  }
+  frames.clear();
+  FrameEnd end;
+  while (fIndex.read(reinterpret_cast<char*>(&end), sizeof(end))) {
+    frames.push_back(end);
+  }
+  return true;
+}
+
+// Compress in as one gzip member.
+inline void compressFrame(const string& in, string& out) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  deflateInit2(&zs, FRAME_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+  out.resize(deflateBound(&zs, in.size()));
+  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+  zs.avail_in = in.size();
+  zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+  zs.avail_out = out.size();
+  deflate(&zs, Z_FINISH);
+  out.resize(zs.total_out);
+  deflateEnd(&zs);
+}
+
+// Decompress one gzip member of size bytes into out, which must already
+// have the uncompressed size.
+inline bool decompressFrame(const char* data, size_t size, string& out) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  inflateInit2(&zs, 15 + 16);
+  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  zs.avail_in = size;
+  zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+  zs.avail_out = out.size();
+  int ret = inflate(&zs, Z_FINISH);
+  bool ok = ret == Z_STREAM_END && zs.total_out == out.size();
+  inflateEnd(&zs);
+  return ok;
+}
+
+/*
+ * Stream buffer behind FrameWriter. Full frames are handed to the thread
+ * pool and written in order as soon as they are compressed.
+ */
+class FrameBuf : public std::streambuf {
+ public:
+  FrameBuf() : _logical(0), _compressed(0) { resetBuffer(); }
+
+  ~FrameBuf() { close(); }
+
+  bool open(const string& filename) {
+    _fData.open(filename.c_str(), std::ios::binary);
+    _fIndex.open((filename + FRAME_INDEX_SUFFIX).c_str(), std::ios::binary);
+    _fIndex.write(FRAME_INDEX_MAGIC, FRAME_INDEX_HEADER);
+    _logical = _compressed = 0;
+    return start();
+  }
+
+  // Reopen filename and drop everything after the frame ending at logical
+  // offset end.
+  bool openAt(const string& filename, uint64_t end) {
+    vector<FrameEnd> frames;
+    if (!readFrameIndex(filename, frames)) {
+      return false;
+    }
+    size_t numFrames = 0;
+    FrameEnd last = {0, 0};
+    while (numFrames < frames.size() && last.logical < end) {
+      last = frames[numFrames++];
+    }
+    string indexFile = filename + FRAME_INDEX_SUFFIX;
+    if (last.logical != end ||
+        truncate(filename.c_str(), last.compressed) == -1 ||
+        truncate(indexFile.c_str(), FRAME_INDEX_HEADER +
+          numFrames * sizeof(FrameEnd)) == -1) {
+      return false;
+    }
+
+    _fData.open(filename.c_str(), std::ios::binary | std::ios::app);
+    _fIndex.open(indexFile.c_str(), std::ios::binary | std::ios::app);
+    _logical = last.logical;
+    _compressed = last.compressed;
+    return start();
+  }
+
+  bool is_open() const { return _fData.is_open() && _fIndex.is_open(); }
+
+  void close() {
+    if (is_open()) {
+      sync();
+      _fData.close();
+      _fIndex.close();
+    }
+  }
+
+  // Append the frames of the framed file filename as they are.
+  bool appendFrames(const string& filename) {
+    vector<FrameEnd> frames;
+    std::ifstream fIn(filename.c_str(), std::ios::binary);
+    if (!readFrameIndex(filename, frames) || !fIn.is_open()) {
+      return false;
+    }
+    sync();
+    if (!frames.empty()) {
+      _fData << fIn.rdbuf();
+    }
+    for (FrameEnd end : frames) {
+      end.logical += _logical;
+      end.compressed += _compressed;
+      _fIndex.write(reinterpret_cast<const char*>(&end), sizeof(end));
+    }
+    if (!frames.empty()) {
+      _logical += frames.back().logical;
+      _compressed += frames.back().compressed;
+    }
+    return static_cast<bool>(_fData);
+  }
+
+ protected:
+  int_type overflow(int_type c) {
+    endFrame();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  // Close the current frame and wait until all frames are written.
+  int sync() {
+    endFrame();
+    writeFrames(0);
+    _fData.flush();
+    _fIndex.flush();
+    return _fData && _fIndex ? 0 : -1;
+  }
+
+  // Only reports the position, i.e. the number of logical bytes.
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+      std::ios_base::openmode which) {
+    if (off != 0 || dir != std::ios_base::cur || !(which & std::ios::out)) {
+      return pos_type(off_type(-1));
+    }
+    return pos_type(off_type(_logical + (pptr() - pbase())));
+  }
+
+ private:
+  struct Frame {
+    string data;
+    uint64_t logicalEnd;
+    bool done;
+  };
+
+  bool start() {
+    if (!_pool) {
+      _pool.reset(new ThreadPool(ThreadPool::defaultSize()));
+    }
+    resetBuffer();
+    return is_open();
+  }
+
+  void resetBuffer() {
+    _buffer.resize(FRAME_SIZE);
+    setp(&_buffer[0], &_buffer[0] + _buffer.size());
+  }
+
+  void endFrame() {
+    size_t size = pptr() - pbase();
+    if (size == 0 || !_pool) {
+      resetBuffer();
+      return;
+    }
+
+    std::shared_ptr<Frame> frame(new Frame());
+    _buffer.resize(size);
+    frame->data.swap(_buffer);
+    _logical += size;
+    frame->logicalEnd = _logical;
+    frame->done = false;
+    _pending.push_back(frame);
+    _pool->submit([this, frame]() {
+        string compressed;
+        compressFrame(frame->data, compressed);
+        std::lock_guard<std::mutex> lock(_mutex);
+        frame->data.swap(compressed);
+        frame->done = true;
+        _frameDone.notify_all();
+      });
+
+    resetBuffer();
+    writeFrames(_pool->size() * FRAMES_IN_FLIGHT);
+  }
+
+  // Write the compressed frames in order, until at most maxPending frames
+  // are left.
+  void writeFrames(size_t maxPending) {
+    while (!_pending.empty()) {
+      std::shared_ptr<Frame> frame = _pending.front();
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (!frame->done && _pending.size() <= maxPending) {
+          return;
+        }
+        _frameDone.wait(lock, [&frame]() { return frame->done; });
+      }
+
+      _fData.write(frame->data.data(), frame->data.size());
+      _compressed += frame->data.size();
+      FrameEnd end = {frame->logicalEnd, _compressed};
+      _fIndex.write(reinterpret_cast<const char*>(&end), sizeof(end));
+      _pending.pop_front();
+    }
+  }
+
+  std::unique_ptr<ThreadPool> _pool;
+  std::ofstream _fData;
+  std::ofstream _fIndex;
+  string _buffer;
+  uint64_t _logical;     // Bytes in all frames handed to the pool
+  uint64_t _compressed;  // Bytes written to _fData
+  std::deque<std::shared_ptr<Frame>> _pending;
+  std::mutex _mutex;
+  std::condition_variable _frameDone;
+};
+
+/*
+ * Output stream writing a framed file, e.g. "detail_ner.gz". tellp() is the
+ * logical offset; flush() ends the current frame and writes all frames, so
+ * the file can be reopened with openAt(tellp()).
+ */
+class FrameWriter : public std::ostream {
+ public:
+  FrameWriter() : std::ostream(&_buf) {}
+
+  explicit FrameWriter(const string& filename) : std::ostream(&_buf) {
+    open(filename);
+  }
+
+  void open(const string& filename) {
+    if (!_buf.open(filename)) {
+      setstate(std::ios::failbit);
+    }
+  }
+
+  void openAt(const string& filename, uint64_t end) {
+    if (!_buf.openAt(filename, end)) {
+      setstate(std::ios::failbit);
+    }
+  }
+
+  bool is_open() const { return _buf.is_open(); }
+
+  void close() { _buf.close(); }
+
+  bool appendFrames(const string& filename) {
+    return _buf.appendFrames(filename);
+  }
+
+ private:
+  FrameBuf _buf;
+};
+
+/*
+ * Random access to the logical bytes of a framed file. Only the frame
+ * holding the current offset is kept decompressed.
+ */
+class FrameReader {
+ public:
+  explicit FrameReader(const string& filename) : _pos(0), _frameIdx(0),
+    _frameBegin(0), _frameLoaded(false) {
+    _fd = open(filename.c_str(), O_RDONLY);
+    // A stale index, e.g. of an earlier file of the same name, does not end
+    // where the file does.
+    struct stat st;
+    if (_fd >= 0 && (!readFrameIndex(filename, _frames) ||
+          fstat(_fd, &st) != 0 || static_cast<uint64_t>(st.st_size) !=
+          (_frames.empty() ? 0 : _frames.back().compressed))) {
+      ::close(_fd);
+      _fd = -1;
+    }
+  }
+
+  ~FrameReader() { close(); }
+
+  bool is_open() const { return _fd >= 0; }
+
+  uint64_t size() const {
+    return _frames.empty() ? 0 : _frames.back().logical;
+  }
+
+  uint64_t tellg() const { return _pos; }
+
+  void seekg(uint64_t offset) { _pos = std::min(offset, size()); }
+
+  void close() {
+    if (_fd >= 0) {
+      ::close(_fd);
+    }
+    _fd = -1;
+  }
+
+  bool getline(string& line) {
+    line.clear();
+    bool extracted = false;
+    while (_pos < size() && loadFrame()) {
+      const char* begin = _frame.data() + (_pos - _frameBegin);
+      const char* end = _frame.data() + _frame.size();
+      const char* newline = static_cast<const char*>(
+          memchr(begin, '\n', end - begin));
+      extracted = true;
+      if (newline != NULL) {
+        line.append(begin, newline);
+        _pos += newline - begin + 1;
+        return true;
+      }
+      line.append(begin, end);
+      _pos += end - begin;
+    }
+    return extracted;
+  }
+
+  // Copy up to size bytes at the current offset, return their number.
+  size_t read(char* buf, size_t size) {
+    size_t n = 0;
+    while (n < size && _pos < this->size() && loadFrame()) {
+      size_t len = std::min(size - n,
+          static_cast<size_t>(_frameBegin + _frame.size() - _pos));
+      memcpy(buf + n, _frame.data() + (_pos - _frameBegin), len);
+      n += len;
+      _pos += len;
+    }
+    return n;
+  }
+
+ private:
+  // Decompress the frame holding _pos unless it is already loaded.
+  bool loadFrame() {
+    if (_frameLoaded && _pos >= _frameBegin &&
+        _pos < _frameBegin + _frame.size()) {
+      return true;
+    }
+
+    auto it = std::upper_bound(_frames.begin(), _frames.end(), _pos,
+        [](uint64_t pos, const FrameEnd& end) { return pos < end.logical; });
+    _frameIdx = it - _frames.begin();
+    FrameEnd begin = _frameIdx == 0 ? FrameEnd({0, 0}) :
+      _frames[_frameIdx - 1];
+    _compressedFrame.resize(it->compressed - begin.compressed);
+    _frame.resize(it->logical - begin.logical);
+    _frameBegin = begin.logical;
+
+    size_t done = 0;
+    while (done < _compressedFrame.size()) {
+      ssize_t n = pread(_fd, &_compressedFrame[done],
+          _compressedFrame.size() - done, begin.compressed + done);
+      if (n <= 0) {
+        break;
+      }
+      done += n;
+    }
+    _frameLoaded = done == _compressedFrame.size() && decompressFrame(
+        _compressedFrame.data(), _compressedFrame.size(), _frame);
+    if (!_frameLoaded) {
+      std::cout << "Cannot decompress frame " << _frameIdx << "\n";
+    }
+    return _frameLoaded;
+  }
+
+  int _fd;
+  vector<FrameEnd> _frames;
+  uint64_t _pos;
+  size_t _frameIdx;
+  uint64_t _frameBegin;
+  bool _frameLoaded;
+  string _frame;
+  string _compressedFrame;
+};
+
+// Open filename for writing, as a framed file if framed.
+inline std::unique_ptr<std::ostream> openOutput(const string& filename,
+    bool framed) {
+  if (framed) {
+    return std::unique_ptr<std::ostream>(new FrameWriter(filename));
+  }
+  return std::unique_ptr<std::ostream>(new std::ofstream(filename.c_str()));
+}
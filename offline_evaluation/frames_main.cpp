@@ -0,0 +1,99 @@
+// Copyright 2020, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Yi-Chun Lin <circle40191@gmail.com>
+
+#include <cstdio>
+#include "async_reader.hpp"
+#include "frames.hpp"
+#include "trace.hpp"
+#include "utils.hpp"
+
+using std::cout;
+
+/*
+ * Compress inFile (plain or "-" for stdin) into the framed file outFile.
+ */
+void compressFile(const string& inFile, const string& outFile) {
+  TRACE_SPAN("compress");
+  LineReader fIn(inFile);
+  FrameWriter fOut(outFile);
+  uint64_t fileSize = fIn.size();
+  string line;
+  while (fIn.getline(line)) {
+    fOut << line << '\n';
+    if (fIn.seekable()) {
+      printProgress(fIn.tellg(), fileSize);
+    }
+  }
+  uint64_t logical = fOut.tellp();
+  fOut.close();
+  fIn.close();
+
+  vector<FrameEnd> frames;
+  readFrameIndex(outFile, frames);
+  uint64_t compressed = frames.empty() ? 0 : frames.back().compressed;
+  printf("\n%lu bytes in %lu frames, compressed to %lu bytes (%.1f%%)\n",
+      logical, frames.size(), compressed,
+      logical == 0 ? 0.0 : compressed * 100.0 / logical);
+}
+
+/*
+ * Write numLines lines of the framed file inFile, starting at the logical
+ * offset, to stdout. All lines to the end if numLines is 0.
+ */
+void catFile(const string& inFile, const uint64_t offset,
+    const uint64_t numLines) {
+  TRACE_SPAN("cat");
+  FrameReader fIn(inFile);
+  if (!fIn.is_open()) {
+    cout << "Cannot open " << inFile << " or its index\n";
+    exit(1);
+  }
+  fIn.seekg(offset);
+  string line;
+  for (uint64_t i = 0; (numLines == 0 || i < numLines) && fIn.getline(line);
+      i++) {
+    fwrite(line.data(), 1, line.size(), stdout);
+    fputc('\n', stdout);
+  }
+}
+
+int main(int argc, char** argv) {
+  startTrace(argc, argv);
+  setReadBackend(argc, argv);
+  vector<string> args = getPositionalArgs(argc, argv,
+      {"--offset", "--lines", "--trace", "--io"});
+  if (args.size() < 2 || (args[0] == "compress" && args.size() < 3) ||
+      (args[0] != "compress" && args[0] != "cat")) {
+    cout << "\nUsage: \n" <<
+      "  frames_main compress <file> <framed_file> " <<
+      "[ --trace <trace.json> ] [ --io <auto|uring|threads> ]\n" <<
+      "  frames_main cat <framed_file> [ --offset <bytes> ] " <<
+      "[ --lines <n> ]\n" <<
+      "\nDescription: \n" <<
+      "  Seekable compressed files as written with --compress, see " <<
+      "frames.hpp.\n\n" <<
+      "  compress\n" <<
+      "    Compress an existing IOB or detail file (\"-\" for stdin). " <<
+      "Byte offsets into it stay valid.\n\n" <<
+      "  cat\n" <<
+      "    Print the uncompressed lines. The whole file is also readable " <<
+      "with zcat.\n\n" <<
+      "  --offset <bytes>\n" <<
+      "    Start at this offset of the uncompressed file, e.g. a line " <<
+      "offset from a detail file.\n\n" <<
+      "  --lines <n>\n" <<
+      "    Only print n lines.\n\n" <<
+      TRACE_USAGE <<
+      IO_USAGE;
+    return 1;
+  }
+
+  if (args[0] == "compress") {
+    compressFile(args[1], args[2]);
+  } else {
+    catFile(args[1], std::stoull(getOption(argc, argv, "--offset", "0")),
+        std::stoull(getOption(argc, argv, "--lines", "0")));
+  }
+  return 0;
+}
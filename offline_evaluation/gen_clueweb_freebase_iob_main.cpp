@@ -3,61 +3,282 @@
 // Yi-Chun Lin <circle40191@gmail.com>
 
 #include <fstream>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include "async_reader.hpp"
+#include "dedup.hpp"
+#include "frames.hpp"
+#include "pipeline.hpp"
+#include "trace.hpp"
 #include "utils.hpp"
 
 using std::cout;
 
 const char OUTPUT_FILE_PREFIX[] = "clueweb-freebase-iob-annotations";
 const uint64_t RECORD_NUM = 1499211974;
+const uint64_t CHECKPOINT_EVERY = 1000000;
+const size_t QUICKSEEK_PROBES = READ_QUEUE_DEPTH;
 
-inline void getNextWord(
-    std::ifstream& f, vector<string>& fields, vector<string>& remaining) {
-  // Due to unknown reasons, wordsfile sometimes contains spaces in a word,
-  // which breaks our assumption in docsfile as we use " " as delimeter.
-  // So we use " " to further splits the word in wordsfile just in case.
+/*
+ * Everything needed to continue an interrupted run after the last fully
+ * written line. Offsets point to the next docsfile line and to the first
+ * wordsfile line of a later docsfile line (-1 if the wordsfile is exhausted).
+ */
+struct Checkpoint {
+  uint64_t lineIdx;
+  uint64_t outputBytes;
+  int64_t docsOffset;
+  int64_t wordsOffset;
+};
+
+/*
+ * One docsfile line with its wordsfile lines, as cut by the source. The
+ * transforms split them into text and words. The reader positions after the
+ * line are kept for the checkpoints.
+ */
+struct DocsLine {
+  uint64_t lineIdx;
   string line;
-  if (remaining.empty()) {
-    if (std::getline(f, line)) {
-      fields = tokenlize(line, '\t');
-      remaining = tokenlize(fields[0], ' ');
-      std::reverse(remaining.begin(), remaining.end());
-    } else {
-      fields = {"", "-1", "-1"};
-      remaining = {""};
+  string wordsLines;  // Each ending in '\n'
+  string text;
+  vector<std::pair<string, bool>> words;  // Word, is entity
+  string output;
+  uint64_t fingerprint;
+  int64_t docsOffset;
+  int64_t wordsOffset;
+};
+
+// The next wordsfile line, read ahead by the source.
+struct WordsLine {
+  string line;
+  uint64_t lineIdx;  // UINT64_MAX at the end of the file
+  int64_t offset;    // -1 at the end of the file
+};
+
+// Read the next wordsfile line, only parsing its docsfile line number.
+inline void getNextWordsLine(LineReader& f, WordsLine& next) {
+  next.offset = f.tellg();
+  if (!f.getline(next.line)) {
+    next.lineIdx = UINT64_MAX;
+    next.offset = -1;
+    return;
+  }
+  std::size_t pos = next.line.find('\t');
+  pos = pos == string::npos ? pos : next.line.find('\t', pos + 1);
+  next.lineIdx = pos == string::npos ? 0 :
+    strtoull(next.line.c_str() + pos + 1, NULL, 10);
+}
+
+/*
+ * Split the docsfile line and the wordsfile lines cut by the source into the
+ * text and the words. Fields are split in place, into the same tokens as
+ * tokenlize().
+ */
+void splitWords(DocsLine& item) {
+  std::size_t tabPos = item.line.find('\t');
+  item.text = tabPos == string::npos ? "" : item.line.substr(tabPos + 1,
+      item.line.find('\t', tabPos + 1) - tabPos - 1);
+
+  const string& lines = item.wordsLines;
+  std::size_t begin = 0;
+  while (begin < lines.size()) {
+    std::size_t end = lines.find('\n', begin);
+    std::size_t wordEnd = std::min(lines.find('\t', begin), end);
+    bool isEntity = wordEnd < end && lines.compare(wordEnd + 1,
+        std::min(lines.find('\t', wordEnd + 1), end) - wordEnd - 1, "1") == 0;
+
+    // Due to unknown reasons, wordsfile sometimes contains spaces in a word,
+    // which breaks our assumption in docsfile as we use " " as delimeter.
+    // So we use " " to further splits the word in wordsfile just in case.
+    for (std::size_t pos = begin; pos < wordEnd;) {
+      std::size_t space = std::min(lines.find(' ', pos), wordEnd);
+      item.words.push_back(std::make_pair(lines.substr(pos, space - pos),
+            isEntity));
+      pos = space + 1;
+    }
+    begin = end + 1;
+  }
+}
+
+// Flush the output (and its frame index) to disk, then atomically replace
+// the checkpoint file.
+void writeCheckpoint(const string& outFile, std::ostream& fOut,
+    const Checkpoint& cp) {
+  TRACE_SPAN("checkpoint");
+  fOut.flush();
+  int fd;
+  for (const string& file : {outFile, outFile + FRAME_INDEX_SUFFIX}) {
+    fd = open(file.c_str(), O_WRONLY);
+    if (fd != -1) {
+      fsync(fd);
+      close(fd);
     }
   }
-  fields[0] = remaining.back();
-  remaining.pop_back();
+
+  string cpFile = outFile + ".checkpoint";
+  string tmpFile = cpFile + ".tmp";
+  std::ofstream fCp(tmpFile.c_str());
+  fCp << "line_idx " << cp.lineIdx << "\n"
+    << "output_bytes " << cp.outputBytes << "\n"
+    << "docs_offset " << cp.docsOffset << "\n"
+    << "words_offset " << cp.wordsOffset << "\n";
+  fCp.close();
+
+  fd = open(tmpFile.c_str(), O_WRONLY);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+  rename(tmpFile.c_str(), cpFile.c_str());
 }
 
-void quickSeek(std::ifstream& f, const uint64_t goal, const int tokenPos) {
-  uint64_t curIdx = 0;
+bool readCheckpoint(const string& outFile, Checkpoint& cp) {
+  std::ifstream fCp((outFile + ".checkpoint").c_str());
+  std::unordered_map<string, string> values;
   string line;
-  std::streampos left, right, pos;
 
-  left = 0;
-  f.seekg(0, f.end);
-  right = f.tellg();
-  f.seekg(0);
+  while (std::getline(fCp, line)) {
+    std::size_t pos = line.find(' ');
+    if (pos != string::npos) {
+      values[line.substr(0, pos)] = line.substr(pos + 1);
+    }
+  }
+
+  for (const char* key : {"line_idx", "output_bytes", "docs_offset",
+      "words_offset"}) {
+    if (values.count(key) == 0) {
+      return false;
+    }
+  }
+
+  cp.lineIdx = std::stoull(values["line_idx"]);
+  cp.outputBytes = std::stoull(values["output_bytes"]);
+  cp.docsOffset = std::stoll(values["docs_offset"]);
+  cp.wordsOffset = std::stoll(values["words_offset"]);
+  return true;
+}
+
+/*
+ * Position f right after a line whose tokenPos-th field is goal.
+ *
+ * Each round reads QUICKSEEK_PROBES evenly spaced lines of the remaining
+ * range at once, which shrinks it QUICKSEEK_PROBES + 1 times per network
+ * round trip instead of halving it.
+ */
+void quickSeek(LineReader& f, const uint64_t goal, const int tokenPos) {
+  string line;
+  uint64_t left = 0;
+  uint64_t right = f.size();
+  vector<uint64_t> probes(QUICKSEEK_PROBES);
+  vector<LineReader::ProbedLine> lines;
 
   if (goal == 0) {
-    std::getline(f, line);
+    f.seekg(0);
+    f.getline(line);
     return;
   }
 
-  while (curIdx != goal) {
-    pos = (left + right) / 2;
-    f.seekg(pos);
-    std::getline(f, line);  // The first line may be incomplete
-    std::getline(f, line);
-    curIdx = stoi(tokenlize(line, '\t')[tokenPos]);
-    // cout << "jumping to line " << curIdx << "\n";
-    if (curIdx > goal) {
-      right = pos;
+  while (true) {
+    for (size_t k = 0; k < probes.size(); k++) {
+      probes[k] = left + (right - left) * (k + 1) / (probes.size() + 1);
+    }
+    f.probeLines(probes, lines);
+
+    uint64_t newLeft = left, newRight = right;
+    for (size_t k = 0; k < probes.size(); k++) {
+      uint64_t curIdx = lines[k].found ?
+        stoull(tokenlize(lines[k].line, '\t')[tokenPos]) : goal + 1;
+      // cout << "jumping to line " << curIdx << "\n";
+      if (curIdx == goal) {
+        f.seekg(lines[k].end);
+        return;
+      }
+      if (curIdx > goal) {
+        newRight = probes[k];
+        break;
+      }
+      newLeft = probes[k];
+    }
+
+    // Too few bytes left to probe, e.g. goal is the first line: scan them.
+    if (newLeft == left && newRight == right) {
+      f.seekg(left);
+      if (left > 0) {
+        f.getline(line);
+      }
+      uint64_t linePos = f.tellg();
+      while (f.getline(line)) {
+        uint64_t curIdx = stoull(tokenlize(line, '\t')[tokenPos]);
+        if (curIdx == goal) {
+          return;
+        }
+        if (curIdx > goal) {
+          break;
+        }
+        linePos = f.tellg();
+      }
+      f.seekg(linePos);
+      return;
+    }
+    left = newLeft;
+    right = newRight;
+  }
+}
+
+/*
+ * Add the IOB postfixes to the text of a docsfile line, see
+ * genCluewebFreebaseIOB().
+ */
+void annotateLine(DocsLine& item) {
+  const string defaultTextPostfix = "\\?\\O";
+  const std::pair<string, bool> noWord("", false);
+  vector<string> textList = tokenlize(item.text, ' ');
+  vector<string> lastEntityIds = {"", ""};
+  size_t wordIdx = 0;
+  unsigned int textIdx = 0;
+  bool endOfLine = textList.empty();
+
+  // Since wordsFile doesn't contain punctuations but do repeat words
+  // when it's an entity, it's not 1-on-1 mapping to the text. We need
+  // to advance in word and text at different pace. Be careful.
+  while (!endOfLine) {
+    const std::pair<string, bool>& w = wordIdx < item.words.size() ?
+      item.words[wordIdx] : noWord;
+    string& text = textList[textIdx];
+    const string& word = w.first;
+    bool wordIsEntity = w.second;
+    string entityId("");
+    bool wordMatched = wordIsEntity || lowercase(word) == lowercase(text);
+
+    // Note: we need textIdx > 0, otherwise, no previous text to modify.
+    if (wordIsEntity && textIdx > 0) {
+      entityId = word.size() > 29 ? word.substr(28, word.size() - 29) : "B";
+      // Modify previous postfix, no advance in text
+      string& lastText = textList[textIdx - 1];
+      lastText.erase(lastText.end() - 1);
+      lastText += lastEntityIds[0] == entityId ? "I" : entityId;
     } else {
-      left = pos;
+      // Add default postfix to text and advance to next text
+      text = text + defaultTextPostfix;
+      textIdx++;
+      endOfLine = textIdx == textList.size();
+    }
+
+    // As in wordsfile, it takes two lines to represent one entity,
+    // we need to keep track of two last IDs to really tracking an entity of
+    // more than one word.
+    lastEntityIds[0] = lastEntityIds[1];
+    lastEntityIds[1] = entityId;
+
+    if (wordMatched) {
+      // If word matched with text, advance to next word
+      wordIdx++;
     }
   }
+
+  item.output = std::to_string(item.lineIdx) + '\t' +
+    (textList.empty() ? "" : join(textList, ' ')) + '\n';
 }
 
 /*
@@ -70,108 +291,166 @@ void quickSeek(std::ifstream& f, const uint64_t goal, const int tokenPos) {
  * 1) In the case of B, replace B by freebase ID.
  * 2) Since clueweb benchmark doesn't contain tagging information,
  *    all TAGs are replaced by "?".
+ * 3) Every checkpointEvery lines, the output is flushed to disk and a
+ *    checkpoint is written next to it. With resume, the output is truncated
+ *    to the last checkpoint and the run continues from there.
+ * 4) The source stage only cuts the files into the lines of each docsfile
+ *    line. They are split and annotated on all cores and written in order,
+ *    see pipeline.hpp.
+ * 5) With dedupMemory > 0, a line whose text and annotations were already
+ *    written is dropped, see dedup.hpp. On resume, the set of written
+ *    lines is rebuilt from the output.
+ * 6) With compress, the output is written in compressed frames, see
+ *    frames.hpp. Each checkpoint ends a frame.
  */
 void genCluewebFreebaseIOB(
     const string& docsFile, const string& wordsFile, const string& outFile,
-    const uint64_t beginIdx, const uint64_t endIdx) {
-  std::ifstream fDocs(docsFile.c_str());
-  std::ifstream fWords(wordsFile.c_str());
-  std::ofstream fOut(outFile.c_str());
+    const uint64_t beginIdx, const uint64_t endIdx,
+    const uint64_t checkpointEvery, const bool resume,
+    const uint64_t dedupMemory, const bool compress) {
+  LineReader fDocs(docsFile);
+  LineReader fWords(wordsFile);
+  std::ofstream fPlain;
+  FrameWriter fFrames;
+  std::ostream& fOut = compress ? static_cast<std::ostream&>(fFrames) :
+    fPlain;
+  std::unique_ptr<FingerprintSet> seen;
+  if (dedupMemory > 0) {
+    seen.reset(new FingerprintSet(outFile + ".dedup", dedupMemory,
+          endIdx - beginIdx));
+  }
 
-  string line;
-  vector<string> lineFields;
   uint64_t lineIdx = 0;
+  uint64_t lastLineIdx = beginIdx;
+  uint64_t numLines = 0;
+  WordsLine nextWords;
 
-  vector<string> wordFields;
-  vector<string> remainingWords;
-
-  vector<string> lastEntityIds = {"", ""};
+  Checkpoint cp;
+  if (resume && readCheckpoint(outFile, cp)) {
+    cout << "Resuming after line [" << cp.lineIdx << "]...\n";
+    if (compress) {
+      fFrames.openAt(outFile, cp.outputBytes);
+    } else if (truncate(outFile.c_str(), cp.outputBytes) == 0) {
+      fPlain.open(outFile.c_str(), std::ios::app);
+    }
+    if (!(compress ? fFrames.is_open() : fPlain.is_open())) {
+      cout << "Cannot truncate " << outFile << "\n";
+      return;
+    }
+    if (seen) {
+      TRACE_SPAN("dedup_rebuild");
+      LineReader fPrev(outFile);
+      string prevLine;
+      while (fPrev.getline(prevLine)) {
+        seen->insert(sentenceFingerprint(prevLine));
+      }
+      // The statistics only count the lines generated from here on.
+      seen->resetCounts();
+    }
+    fDocs.seekg(cp.docsOffset);
+    fWords.seekg(cp.wordsOffset < 0 ? fWords.size() : cp.wordsOffset);
+    getNextWordsLine(fWords, nextWords);
+    lineIdx = cp.lineIdx;
+  } else {
+    if (resume) {
+      cout << "No checkpoint found, starting from the beginning...\n";
+    }
+    if (compress) {
+      fFrames.open(outFile);
+    } else {
+      fPlain.open(outFile.c_str());
+    }
 
-  const string defaultTextPostfix = "\\?\\O";
+    // Seek starting position
+    // We want to goto the previous line of our goal.
+    if (beginIdx > 0) {
+      TRACE_SPAN("quickSeek");
+      cout << "Seeking starting position [" << beginIdx <<
+        "] in docsFile...\n";
+      quickSeek(fDocs, beginIdx - 1, 0);
 
-  // Seek starting position
-  // We want to goto the previous line of our goal.
-  if (beginIdx > 0) {
-    cout << "Seeking starting position [" << beginIdx << "] in docsFile...\n";
-    quickSeek(fDocs, beginIdx - 1, 0);
+      cout << "Seeking starting position [" << beginIdx <<
+        "] in wordsFile...\n";
+      quickSeek(fWords, beginIdx - 1, 2);
+    }
 
-    cout << "Seeking starting position [" << beginIdx << "] in wordsFile...\n";
-    quickSeek(fWords, beginIdx - 1, 2);
+    getNextWordsLine(fWords, nextWords);
   }
 
-  // Init wordFields and remaining
-  getNextWord(fWords, wordFields, remainingWords);
-
-  // (1) Loop each sentence in the desired range of docsFile
-  while (std::getline(fDocs, line) && lineIdx < endIdx) {
-    bool endOfLine = false;
-    vector<string> textList;
-    unsigned int textIdx = 0;
-
-    lineFields = tokenlize(line, '\t');
-    lineIdx = stoull(lineFields[0]);
-    printProgress(lineIdx - beginIdx, endIdx - beginIdx);
-
-    // Check current line index in wordsFile. Advance in wordsFile until
-    // it's sync with line index in docsFile.
-    while (std::stoull(wordFields[2]) < lineIdx) {
-      getNextWord(fWords, wordFields, remainingWords);
-    }
-
-    // (2) Seperate each sentence by space into words.
-    textList = tokenlize(lineFields[1], ' ');
-
-    // (3) Add proper postfix to all texts in this sentence,
-    //     by looking at all words beloning to this sentence in wordsFile.
-    //     Since wordsFile doesn't contain punctuations but do repeat words
-    //     when it's an entity, it's not 1-on-1 mapping to the text. We need
-    //     to advance in word and text at different pace. Be careful.
-    while (!endOfLine) {
-      string& text = textList[textIdx];
-      const string& word = wordFields[0];
-      bool wordIsEntity = wordFields[1] == "1";
-      string entityId("");
-      bool wordMatched = wordIsEntity || lowercase(word) == lowercase(text);
-
-      // Note: we need textIdx > 0, otherwise, no previous text to modify.
-      if (wordIsEntity && textIdx > 0) {
-        entityId = word.size() > 29 ? word.substr(28, word.size() - 29) : "B";
-        // Modify previous postfix, no advance in text
-        string& lastText = textList[textIdx - 1];
-        lastText.erase(lastText.end() - 1);
-        lastText += lastEntityIds[0] == entityId ? "I" : entityId;
-      } else {
-        // Add default postfix to text and advance to next text
-        text = text + defaultTextPostfix;
-        textIdx++;
-        endOfLine = textIdx == textList.size();
-      }
+  Pipeline<DocsLine> pipeline;
+  pipeline
+    // (1) Loop each sentence in the desired range of docsFile and gather
+    //     its wordsFile lines. Advance in wordsFile until it's sync with
+    //     line index in docsFile.
+    .source("read_docs_words", [&](DocsLine& item) {
+        if (!fDocs.getline(item.line) || lineIdx >= endIdx) {
+          return false;
+        }
+        lineIdx = strtoull(item.line.c_str(), NULL, 10);
+        item.lineIdx = lineIdx;
 
-      // As in wordsfile, it takes two lines to represent one entity,
-      // we need to keep track of two last IDs to really tracking an entity of
-      // more than one word.
-      lastEntityIds[0] = lastEntityIds[1];
-      lastEntityIds[1] = entityId;
+        while (nextWords.lineIdx < lineIdx) {
+          getNextWordsLine(fWords, nextWords);
+        }
+        while (nextWords.lineIdx == lineIdx) {
+          item.wordsLines += nextWords.line;
+          item.wordsLines += '\n';
+          getNextWordsLine(fWords, nextWords);
+        }
 
-      if (wordMatched) {
-        // If word matched with text, advance to next word
-        getNextWord(fWords, wordFields, remainingWords);
-      }
-    }
-    // (4) End of line reached, write processed text to file
-    fOut << lineIdx << '\t' << join(textList, ' ') << '\n';
+        item.docsOffset = fDocs.tellg();
+        item.wordsOffset = nextWords.offset;
+        return true;
+      })
+    // (2) Split the lines and add proper postfix to all texts in this
+    //     sentence.
+    .transform("split_words", splitWords)
+    .transform("annotate", annotateLine);
+  if (seen) {
+    pipeline.transform("fingerprint", [](DocsLine& item) {
+        item.fingerprint = sentenceFingerprint(item.output);
+      });
   }
+  pipeline
+    // (3) Write processed text to file, unless it is a duplicate.
+    .sink("write_output", [&](DocsLine& item) {
+        if (!seen || seen->insert(item.fingerprint)) {
+          fOut << item.output;
+        }
+        lastLineIdx = item.lineIdx;
+        if (++numLines % checkpointEvery == 0) {
+          cp = {item.lineIdx, static_cast<uint64_t>(fOut.tellp()),
+            item.docsOffset, item.wordsOffset};
+          writeCheckpoint(outFile, fOut, cp);
+        }
+      })
+    .progress([&](uint64_t) {
+        printPercent(lastLineIdx - beginIdx, endIdx - beginIdx);
+      })
+    .run();
 
+  if (seen) {
+    printDedupStats(*seen);
+  }
   fDocs.close();
   fWords.close();
-  fOut.close();
+  fPlain.close();
+  fFrames.close();
+  remove((outFile + ".checkpoint").c_str());
 }
 
 int main(int argc, char** argv) {
-  if (argc < 4) {
+  startTrace(argc, argv);
+  vector<string> args = getPositionalArgs(argc, argv,
+      {"--checkpoint-every", "--dedup-memory", "--trace", "--io"});
+  if (args.size() < 3) {
     cout << "\nUsage: \n" <<
       "  gen_clueweb_freebase_iob_main <docsfile> <wordsfile> " <<
       "<output_dir> [ <from> ] [ <to> ]\n" <<
+      "    [ --resume ] [ --checkpoint-every <lines> ] " <<
+      "[ --trace <trace.json> ]\n" <<
+      "    [ --dedup ] [ --dedup-memory <MB> ] [ --compress ] " <<
+      "[ --io <auto|uring|threads> ]\n" <<
       "\nDescription: \n" <<
       "  Generate the IOB ground truth of clueweb with freebase_id for " <<
       "NER_NED usage. \n\n" <<
@@ -183,21 +462,45 @@ int main(int argc, char** argv) {
       "  <from> <to>\n" <<
       "    Specify the range of the record id(stated in docsfile) that " <<
       "you want to generate.\n" <<
-      "    Default from 0 to " << RECORD_NUM << ".\n\n";
+      "    Default from 0 to " << RECORD_NUM << ".\n\n" <<
+      "  --resume\n" <<
+      "    Continue an interrupted run from its last checkpoint.\n\n" <<
+      "  --checkpoint-every <lines>\n" <<
+      "    Flush the output and write a checkpoint every <lines> lines. " <<
+      "Default " << CHECKPOINT_EVERY << ".\n\n" <<
+      "  --dedup\n" <<
+      "    Drop lines whose text and annotations were already written.\n\n" <<
+      "  --dedup-memory <MB>\n" <<
+      "    Memory for the set of written lines, which is spilled to disk " <<
+      "beyond it. Default " << DEDUP_MEMORY_MB << ".\n\n" <<
+      "  --compress\n" <<
+      "    Write <output>.gz in seekable compressed frames, which all " <<
+      "tools read like the plain file.\n\n" <<
+      TRACE_USAGE <<
+      IO_USAGE;
     return 1;
   }
 
-  uint64_t from = argc > 5 ? atoll(argv[4]) : 0;
-  uint64_t to = argc > 5 ? atoll(argv[5]) : RECORD_NUM;
+  uint64_t from = args.size() > 4 ? atoll(args[3].c_str()) : 0;
+  uint64_t to = args.size() > 4 ? atoll(args[4].c_str()) : RECORD_NUM;
   from = from > RECORD_NUM ? RECORD_NUM : from;
   to = to > RECORD_NUM || to < from ? RECORD_NUM : to;
 
+  bool compress = hasOption(argc, argv, "--compress");
   char outputPath[512] = "\0";
   snprintf(outputPath, sizeof(outputPath),
-      "%s/%s.%lu-%lu", argv[3], OUTPUT_FILE_PREFIX, from, to);
+      "%s/%s.%lu-%lu%s", args[2].c_str(), OUTPUT_FILE_PREFIX, from, to,
+      compress ? FRAME_SUFFIX : "");
   cout << "\nOutput path: " << outputPath << "\n";
 
-  genCluewebFreebaseIOB(argv[1], argv[2], outputPath, from, to);
+  setReadBackend(argc, argv);
+  uint64_t checkpointEvery = getCountOption(argc, argv, "--checkpoint-every",
+      CHECKPOINT_EVERY, 1);
+  uint64_t dedupMemory = !hasOption(argc, argv, "--dedup") ? 0 :
+    getCountOption(argc, argv, "--dedup-memory", DEDUP_MEMORY_MB) << 20;
+  genCluewebFreebaseIOB(args[0], args[1], outputPath, from, to,
+      checkpointEvery, hasOption(argc, argv, "--resume"), dedupMemory,
+      compress);
   cout << "\nDone!\n\n";
   return 0;
 }
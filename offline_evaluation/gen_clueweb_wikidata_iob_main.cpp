@@ -6,154 +6,304 @@
 #include <unordered_map>
 #include <set>
 #include <stdlib.h>
+#include "async_reader.hpp"
+#include "pipeline.hpp"
+#include "trace.hpp"
 #include "utils.hpp"
 
 using std::cout;
 unsigned int seed = time(NULL);
 
-inline string getRandomLine(std::ifstream& f, const std::set<uint64_t>& ids) {
-  uint64_t lineId;
-  string line;
-  std::streampos pos;
+// Random candidates per batch, small since the batch that reaches the
+// target size is wasted.
+const size_t SAMPLE_BATCH_SIZE = 1024;
+
+// Result of rewriting a single line, see replaceIds().
+enum LineStatus {
+  LINE_KEPT = 0,
+  LINE_UNTAGGED,   // First word is an unresolved "[m." placeholder
+  LINE_MALFORMED,  // Missing tab field or a word without "\" postfix
+  LINE_UNMAPPED,   // Some freebase id has no wikidata id in the mapping
+  LINE_STATUS_NUM
+};
 
-  f.seekg(0, f.end);
-  pos = f.tellg();
+const char* LINE_STATUS_NAMES[] = {
+  "kept", "dropped_untagged", "dropped_malformed", "dropped_unmapped"
+};
+
+// One input line and its rewritten form, see replaceIds().
+struct IobLine {
+  string line;
+  string out;
+  LineStatus status;
+};
 
-  while (true) {
-    pos = pos * (1.0 * rand_r(&seed) / RAND_MAX);
+// Read numLines random lines of f at once.
+inline void getRandomLines(LineReader& f, const size_t numLines,
+    vector<string>& lines) {
+  vector<uint64_t> offsets(numLines);
+  vector<LineReader::ProbedLine> probes;
 
-    f.seekg(pos);
-    std::getline(f, line);  // The first line may be incomplete
-    std::getline(f, line);
-    lineId = stoi(tokenlize(line, '\t')[0]);
+  for (auto& offset : offsets) {
+    offset = f.size() * (1.0 * rand_r(&seed) / RAND_MAX);
+  }
+  f.probeLines(offsets, probes);
 
-    if (ids.find(lineId) == ids.end()) {
-      break;
+  lines.clear();
+  for (const auto& probe : probes) {
+    if (probe.found) {
+      lines.push_back(probe.line);
     }
   }
+}
 
-  return line;
+// Line format: <http://www.wikidata.org/entity/xxx>,"/m/xxx"
+bool parseIdMapping(const string& line, string& freebaseId,
+    string& wikidataId) {
+  vector<string> idList = tokenlize(line, ',');
+  std::size_t pos = idList.size() == 2 ? idList[1].rfind("/") : string::npos;
+
+  if (idList.size() != 2 ||
+      idList[0].size() < 34 ||
+      idList[1].size() < 4 ||
+      pos == std::string::npos) {
+    return false;
+  }
+
+  idList[0].erase(idList[0].end() - 1);
+  idList[1].erase(idList[1].end() - 1);
+  idList[1].replace(pos, 1, ".");
+  freebaseId = idList[1].substr(2);
+  wikidataId = idList[0].substr(32);
+  return true;
+}
+
+void loadIdMapping(const string& mapFile,
+    std::unordered_map<string, string>& idMapping) {
+  TRACE_SPAN("load_id_mapping");
+  loadMapping(mapFile, parseIdMapping, idMapping);
 }
 
 /*
- * Generate clueweb IOB file with wikidata_id for NER_NED, by
- * replacing freebase_id in input IOB file, using the mapping given.
+ * Replace the freebase ids of one IOB line by wikidata ids.
+ * On LINE_KEPT, the rewritten line (without '\n') is stored in out.
  */
-void genCluewebWikidataIOB(const string& inFile, const string& mapFile,
-    const uint64_t targetSize, const string& outFile) {
-  std::ifstream fIn(inFile.c_str());
-  std::ifstream fMap(mapFile.c_str());
-  std::ofstream fOut(outFile.c_str());
-
-  string line;
+LineStatus replaceIds(const string& line,
+    const std::unordered_map<string, string>& idMapping,
+    string& out, vector<string>& lineFields, vector<string>& textList) {
   std::size_t pos;
-  std::set<uint64_t> lineIds;
 
-  std::unordered_map<string, string> idMapping;
-  vector<string> idList;
-  string wikidataId, freebaseId;
+  tokenlize(line, '\t', lineFields);
+  if (lineFields.size() < 2) {
+    return LINE_MALFORMED;
+  }
 
-  cout << "Loading id mapping file...\n";
-  // Line format: <http://www.wikidata.org/entity/xxx>,"/m/xxx"
-  while (std::getline(fMap, line)) {
-    idList = tokenlize(line, ',');
-    pos = idList.size() == 2 ? idList[1].rfind("/") : string::npos;
-
-    if (idList.size() != 2 ||
-        idList[0].size() < 34 ||
-        idList[1].size() < 4 ||
-        pos == std::string::npos) {
+  tokenlize(lineFields[1], ' ', textList);
+  if (textList.empty()) {
+    return LINE_MALFORMED;
+  }
+
+  if (textList[0].substr(0, 3) == "[m.") {
+    return LINE_UNTAGGED;
+  }
+
+  for (auto& text : textList) {
+    if ((pos = text.rfind("\\")) == string::npos) {
+      return LINE_MALFORMED;
+    }
+
+    string freebaseId = text.substr(pos+1);
+    if (freebaseId == "I" || freebaseId == "O") {
       continue;
     }
 
-    idList[0].erase(idList[0].end() - 1);
-    idList[1].erase(idList[1].end() - 1);
-    idList[1].replace(pos, 1, ".");
-    wikidataId = idList[0].substr(32);
-    freebaseId = idList[1].substr(2);
-    idMapping[freebaseId] = wikidataId;
+    auto it = idMapping.find(freebaseId);
+    if (it == idMapping.end()) {
+      return LINE_UNMAPPED;
+    }
+    text.replace(pos+1, string::npos, it->second);
   }
 
+  out = lineFields[0] + '\t' + join(textList, ' ');
+  return LINE_KEPT;
+}
+
+// Transform stage: replaceIds() with per-thread scratch space.
+void replaceIdsStage(IobLine& item,
+    const std::unordered_map<string, string>& idMapping) {
+  thread_local vector<string> lineFields;
+  thread_local vector<string> textList;
+  item.status = replaceIds(item.line, idMapping, item.out, lineFields,
+      textList);
+}
+
+/*
+ * Generate clueweb IOB file with wikidata_id for NER_NED, by
+ * replacing freebase_id in input IOB file, using the mapping given.
+ *
+ * Candidates are drawn in batches of random lines to overlap the random
+ * reads and rewritten on all cores, see pipeline.hpp.
+ */
+void genCluewebWikidataIOB(const string& inFile,
+    const std::unordered_map<string, string>& idMapping,
+    const uint64_t targetSize, const string& outFile, const bool compress) {
+  LineReader fIn(inFile);
+  if (!fIn.is_open()) {
+    cout << "Cannot open " << inFile << "\n";
+    exit(1);
+  }
+  std::unique_ptr<std::ostream> fOut = openOutput(outFile, compress);
+
+  vector<string> lines;
+  size_t nextLine = 0;
+  std::set<uint64_t> lineIds;
+
   cout << "Replacing ids...\n";
-  while (lineIds.size() < targetSize) {
-    printProgress(lineIds.size(), targetSize);
-    bool valid = true;
-    vector<string> lineFields;
-    vector<string> textList;
+  Pipeline<IobLine>(SAMPLE_BATCH_SIZE)
+    .source("sample_lines", [&](IobLine& item) {
+        while (lineIds.size() < targetSize) {
+          if (nextLine == lines.size()) {
+            getRandomLines(fIn, READ_QUEUE_DEPTH, lines);
+            nextLine = 0;
+            continue;
+          }
+          item.line = lines[nextLine++];
+          if (lineIds.find(atoll(item.line.c_str())) == lineIds.end()) {
+            return true;
+          }
+        }
+        return false;
+      })
+    .transform("replace_ids", [&](IobLine& item) {
+        replaceIdsStage(item, idMapping);
+      })
+    .sink("write_output", [&](IobLine& item) {
+        // The same line may have been drawn twice in a batch.
+        uint64_t lineId = atoll(item.out.c_str());
+        if (item.status != LINE_KEPT || lineIds.size() >= targetSize ||
+            !lineIds.insert(lineId).second) {
+          return;
+        }
+        *fOut << item.out << '\n';
+      })
+    .progress([&](uint64_t) { printPercent(lineIds.size(), targetSize); })
+    .run();
 
-    line = getRandomLine(fIn, lineIds);
-    lineFields = tokenlize(line, '\t');
-    textList = tokenlize(lineFields[1], ' ');
+  fIn.close();
+  fOut.reset();
+}
 
-    if (textList[0].substr(0, 3) == "[m.") {
-      continue;
-    }
+/*
+ * Rewrite the whole input IOB file with wikidata_id, keeping the line order.
+ *
+ * Lines are rewritten on all cores and written back in the original order,
+ * see pipeline.hpp. Dropped lines are counted per LineStatus and reported at
+ * the end.
+ */
+void rewriteCluewebWikidataIOB(const string& inFile,
+    const std::unordered_map<string, string>& idMapping,
+    const string& outFile, const bool compress) {
+  LineReader fIn(inFile);
+  if (!fIn.is_open()) {
+    cout << "Cannot open " << inFile << "\n";
+    exit(1);
+  }
+  std::unique_ptr<std::ostream> fOut = openOutput(outFile, compress);
 
-    for (auto& text : textList) {
-      if ((pos = text.rfind("\\")) == string::npos) {
-        valid = false;
-        break;
-      }
-
-      freebaseId = text.substr(pos+1);
-      if (freebaseId == "I" || freebaseId == "O") {
-        continue;
-      }
-
-      if (idMapping.find(freebaseId) == idMapping.end()) {
-        valid = false;
-        break;
-      }
-      wikidataId = idMapping[freebaseId];
-      text.replace(pos+1, string::npos, wikidataId);
-    }
+  vector<uint64_t> counts(LINE_STATUS_NUM, 0);
+  uint64_t fileSize = fIn.size();
+  auto readLine = lineSource(fIn);
 
-    if (valid) {
-      string lineId = lineFields[0];
-      fOut << lineId << '\t' << join(textList, ' ') << '\n';
-      lineIds.insert(atoll(lineId.c_str()));
-    }
+  cout << "Replacing ids...\n";
+  Pipeline<IobLine>()
+    .source("read_lines", [&](IobLine& item) { return readLine(item.line); })
+    .transform("replace_ids", [&](IobLine& item) {
+        replaceIdsStage(item, idMapping);
+      })
+    .sink("write_output", [&](IobLine& item) {
+        counts[item.status]++;
+        if (item.status == LINE_KEPT) {
+          *fOut << item.out << '\n';
+        }
+      })
+    .progress([&](uint64_t) { printPercent(fIn.tellg(), fileSize); })
+    .run();
+
+  cout << "\n";
+  for (int s = 0; s < LINE_STATUS_NUM; s++) {
+    cout << LINE_STATUS_NAMES[s] << ": " << counts[s] << "\n";
   }
 
   fIn.close();
-  fMap.close();
-  fOut.close();
+  fOut.reset();
 }
 
 int main(int argc, char** argv) {
-  if (argc < 4) {
+  startTrace(argc, argv);
+  setReadBackend(argc, argv);
+  vector<string> args = getPositionalArgs(argc, argv, {"--trace", "--io"});
+  bool validSize = args.size() >= 3 && (args[2] == "all" ||
+      (!args[2].empty() &&
+       args[2].size() <= 19 &&
+       args[2].find_first_not_of("0123456789") == string::npos));
+  if (!validSize) {
     cout << "\nUsage: \n" <<
     "  gen_clueweb_wikidata_iob_main <clueweb-freebase-iob-annotations> "
-    "<id_mapping_csv> <size>\n" <<
+    "<id_mapping_csv> <size> [ --trace <trace.json> ]\n" <<
+    "    [ --compress ] [ --io <auto|uring|threads> ]\n" <<
     "\nDescription: \n" <<
     "  Generate <size> lines of wikidata annoations, by randomly selecting "<<
     "sentences in <clueweb-freebase-iob-annotations> and replacing " <<
     "freebase_id with wikidata_id using the given id mapping file.\n\n" <<
     "  <clueweb_freebase_iob_file> \n" <<
-    "    generated by gen_clueweb_freebase_iob_main\n\n" <<
+    "    generated by gen_clueweb_freebase_iob_main, plain or with " <<
+    "--compress\n\n" <<
     "  <id_mapping_csv> \n" <<
     "    mappings between freebase and wikidata IDs,\n" <<
     "    generated by qLever at http://qlever.informatik.uni-freiburg.de/"
     "Wikidata_Full\n" <<
     "    of line format <http://www.wikidata.org/entity/xxx>,\"/m/xxx\"\n\n"<<
     "  <size> \n" <<
-    "    the number of sentences to generate\n\n";
+    "    the number of sentences to generate\n" <<
+    "    or \"all\" to rewrite the whole file in order using all cores\n\n" <<
+    "  --compress \n" <<
+    "    Write the output in seekable compressed frames, see " <<
+    "frames.hpp\n\n" <<
+    TRACE_USAGE <<
+    IO_USAGE;
     return 1;
   }
 
-  string outputPath = argv[1];
+  bool rewriteAll = args[2] == "all";
+  bool compress = hasOption(argc, argv, "--compress");
+  string outputPath = args[0];
+  if (hasFrameIndex(outputPath)) {
+    outputPath.resize(outputPath.size() - strlen(FRAME_SUFFIX));
+  }
   std::size_t found = outputPath.rfind("freebase");
   if (found != string::npos) {
     outputPath.replace(found, 8, "wikidata");
   } else {
     outputPath += ".wikidata";
   }
-  outputPath += ".random" + string(argv[3]);
+  if (!rewriteAll) {
+    outputPath += ".random" + args[2];
+  }
+  if (compress) {
+    outputPath += FRAME_SUFFIX;
+  }
   cout << "\nOutput path: " << outputPath << "\n";
 
-  genCluewebWikidataIOB(argv[1], argv[2], atoll(argv[3]), outputPath);
+  std::unordered_map<string, string> idMapping;
+  cout << "Loading id mapping file...\n";
+  loadIdMapping(args[1], idMapping);
+
+  if (rewriteAll) {
+    rewriteCluewebWikidataIOB(args[0], idMapping, outputPath, compress);
+  } else {
+    genCluewebWikidataIOB(args[0], idMapping, std::stoull(args[2]),
+        outputPath, compress);
+  }
   cout << "\nDone!\n\n";
   return 0;
 }
-
-
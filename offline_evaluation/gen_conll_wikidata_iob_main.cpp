@@ -4,6 +4,9 @@
 
 #include <fstream>
 #include <unordered_map>
+#include "async_reader.hpp"
+#include "pipeline.hpp"
+#include "trace.hpp"
 #include "utils.hpp"
 
 using std::cout;
@@ -14,171 +17,247 @@ const char INPUT_TESTA[] = "eng.testa";
 const char INPUT_TESTB[] = "eng.testb";
 const char OUTPUT_FILE_NAME[] = "conll-wikidata-iob-annotations";
 
+// One word of a corpus. Entity starts keep their annotation line.
+struct ConllWord {
+  string text;
+  string label;                // "O", "I", or empty to look up annotTokens
+  vector<string> annotTokens;
+};
+
+// One corpus, i.e. the words between two -DOCSTART- lines.
+struct Corpus {
+  int corpusIdx;
+  vector<ConllWord> words;
+  string output;
+};
+
 /*
- * Generate CoNLL-2003 IOB file with wikidata annotations for NER_NED.
- *
- * wikipedia_url of each entity can be obtained by aido-yago2-annotations,
- * which can be further mapped to wikidata_id by the mapping file provided.
- *
- * Output: One corpus per line in the format of
- * CORPUS_NO <TAB> WORD1\TAG1\[IOB] <SPACE> WORD2\TAG2\[IOB] <SPACE> ...
- *
- * Note: In the case of B, replace B by wikidata / wikipedia_url if exist.
+ * Source stage: read the dataset files one after another and match each
+ * entity start with its line in the annotation file.
  */
-void genConllWikidataIOB(
-    const string& annotationFile, const vector<string>& datasetFiles,
-    const string& wikiMapFile, const string& freebaseMapFile,
-    const string& outFile) {
-  std::ifstream fAnnot(annotationFile.c_str());
-  std::ifstream fWikiMap(wikiMapFile.c_str());
-  std::ifstream fFreebaseMap(freebaseMapFile.c_str());
-  std::ofstream fOut(outFile.c_str());
-  int corpusIdx = 0;
-  vector<string> wordList;
+class ConllReader {
+ public:
+  ConllReader(const string& annotationFile, const vector<string>& datasetFiles)
+    : _fAnnot(annotationFile.c_str()), _datasetFiles(datasetFiles),
+    _fileIdx(0), _corpusIdx(0), _done(false) {}
 
-  string mapLine;
-  vector<string> mapTokens;
-  std::unordered_map<string, string> wikiMap;
-  std::unordered_map<string, string> freebaseMap;
-
-  cout << "\nLoading wikipedia url mapping file ...";
-  // Line format:
-  // <https://en.wikipedia.org/wiki/xxx>,<http://www.wikidata.org/entity/xxx>
-  while (std::getline(fWikiMap, mapLine)) {
-    string wikidataId, wikipediaUrl;
-    tokenlize(mapLine, ',', mapTokens);
-
-    if (mapTokens.size() != 2 ||
-        mapTokens[0].size() < 8 ||
-        mapTokens[1].size() < 34) {
-      continue;
+  bool next(Corpus& corpus) {
+    if (_done) {
+      return false;
     }
 
-    mapTokens[0].erase(mapTokens[0].end() - 1);
-    mapTokens[1].erase(mapTokens[1].end() - 1);
-    wikipediaUrl = "http" + mapTokens[0].substr(6);
-    wikidataId = mapTokens[1].substr(32);
-    wikiMap[wikipediaUrl] = wikidataId;
-  }
-
-  cout << "\nLoading freebase id mapping file ...";
-  // Line format: <http://www.wikidata.org/entity/xxx>,"/m/xxx"
-  while (std::getline(fFreebaseMap, mapLine)) {
-    string wikidataId, freebaseId;
-    tokenlize(mapLine, ',', mapTokens);
-
-    if (mapTokens.size() != 2 ||
-        mapTokens[0].size() < 34 ||
-        mapTokens[1].size() < 4) {
-      continue;
-    }
+    while (true) {
+      if (!_fData.is_open()) {
+        if (_fileIdx == _datasetFiles.size()) {
+          // The last corpus
+          _done = true;
+          corpus.corpusIdx = _corpusIdx;
+          corpus.words.swap(_words);
+          return true;
+        }
+        cout << "\nProcessing " << _datasetFiles[_fileIdx] << " ...";
+        _fData.open(_datasetFiles[_fileIdx++].c_str());
+        _prevWordType = "O";
+        _annotTokens.clear();
+      }
 
-    mapTokens[0].erase(mapTokens[0].end() - 1);
-    mapTokens[1].erase(mapTokens[1].end() - 1);
-    wikidataId = mapTokens[0].substr(32);
-    freebaseId = mapTokens[1].substr(1);
-    freebaseMap[freebaseId] = wikidataId;
-  }
+      if (!std::getline(_fData, _dataLine)) {
+        _fData.close();
+        continue;
+      }
 
-  for (const string& filename : datasetFiles) {
-    std::ifstream fData(filename.c_str());
-    string dataLine;
-    string annotLine;
-    vector<string> dataTokens;
-    vector<string> annotTokens;
-    string curWordType = "O";
-    string prevWordType = "O";
-    string IBO;
-
-    cout << "\nProcessing " << filename << " ...";
-    while (std::getline(fData, dataLine)) {
-      string word;
-      tokenlize(dataLine, ' ', dataTokens);
-
-      if (dataTokens.size() == 0) {
+      tokenlize(_dataLine, ' ', _dataTokens);
+      if (_dataTokens.size() == 0) {
         continue;
       }
 
-      if (dataTokens[0] == "-DOCSTART-") {
-        if (corpusIdx > 0) {
-          fOut << corpusIdx << '\t' << join(wordList, ' ') << '\n';
-          wordList.clear();
-          prevWordType = "O";
+      if (_dataTokens[0] == "-DOCSTART-") {
+        bool completed = _corpusIdx > 0;
+        if (completed) {
+          corpus.corpusIdx = _corpusIdx;
+          corpus.words.swap(_words);
+          _words.clear();
+          _prevWordType = "O";
 
           // Read the empty line at the end of each corpus in annotFile
-          std::getline(fAnnot, annotLine);
+          std::getline(_fAnnot, _annotLine);
         }
-        corpusIdx++;
+        _corpusIdx++;
 
         // Read next annotFile -DOCSTART- line.
-        if (std::getline(fAnnot, annotLine)) {
-          if (annotLine.substr(0, 10) != "-DOCSTART-") {
-            cout << corpusIdx << '\t' << "Unexpected format in annotFile. "
-              << "expect -DOCSTART- line, get[" << annotLine << "]\n";
-            return;
+        if (std::getline(_fAnnot, _annotLine)) {
+          if (_annotLine.substr(0, 10) != "-DOCSTART-") {
+            cout << _corpusIdx << '\t' << "Unexpected format in annotFile. "
+              << "expect -DOCSTART- line, get[" << _annotLine << "]\n";
+            _done = true;
+            return completed;
           }
         }
 
+        if (completed) {
+          return true;
+        }
         continue;
       }
 
-      if (dataTokens.size() != 4) {
-        cout << "Unexpected format at corpus " << corpusIdx << " word "
-          << wordList.size() - 1 << ": " << dataLine << "\n";
+      if (_dataTokens.size() != 4) {
+        cout << "Unexpected format at corpus " << _corpusIdx << " word "
+          << _words.size() - 1 << ": " << _dataLine << "\n";
         continue;
       }
 
-      curWordType = dataTokens[3];
+      ConllWord word;
+      word.text = _dataTokens[0];
+      const string& curWordType = _dataTokens[3];
       if (curWordType == "O") {
-        IBO = "O";
+        word.label = "O";
       } else {
-        if (curWordType != prevWordType && std::getline(fAnnot, annotLine)) {
-            tokenlize(annotLine, '\t', annotTokens);
+        if (curWordType != _prevWordType &&
+            std::getline(_fAnnot, _annotLine)) {
+          tokenlize(_annotLine, '\t', _annotTokens);
         }
 
-        if (curWordType == prevWordType) {
-          IBO = "I";
-        } else if (annotTokens.size() >= 5 &&
-            freebaseMap.find(annotTokens[4]) != freebaseMap.end()) {
-          IBO = freebaseMap[annotTokens[4]];
-        } else if (annotTokens.size() >=3 &&
-            wikiMap.find(annotTokens[2]) != wikiMap.end()) {
-          IBO = wikiMap[annotTokens[2]];
+        if (curWordType == _prevWordType) {
+          word.label = "I";
         } else {
-          IBO = "B";
+          word.annotTokens = _annotTokens;
         }
       }
-
-      // Handle &amp;
-      std::size_t pos = dataTokens[0].find("&amp;");
-      if (pos != string::npos) {
-        dataTokens[0] = dataTokens[0].substr(0, pos+1) +
-          dataTokens[0].substr(pos+5);
-      }
-
-      word = dataTokens[0] + "\\?\\" + IBO;
-      wordList.push_back(word);
-      prevWordType = curWordType.substr(0, 1) == "B" ?
+      _words.push_back(word);
+      _prevWordType = curWordType.substr(0, 1) == "B" ?
         "I" + curWordType.substr(1) : curWordType;
     }
+  }
+
+ private:
+  std::ifstream _fAnnot;
+  std::ifstream _fData;
+  vector<string> _datasetFiles;
+  size_t _fileIdx;
+  int _corpusIdx;
+  bool _done;
+  vector<ConllWord> _words;
+  string _prevWordType;
+  string _dataLine;
+  string _annotLine;
+  vector<string> _dataTokens;
+  vector<string> _annotTokens;
+};
 
-    fData.close();
+// Line format:
+// <https://en.wikipedia.org/wiki/xxx>,<http://www.wikidata.org/entity/xxx>
+bool parseWikiMapping(const string& line, string& wikipediaUrl,
+    string& wikidataId) {
+  vector<string> mapTokens = tokenlize(line, ',');
+  if (mapTokens.size() != 2 ||
+      mapTokens[0].size() < 8 ||
+      mapTokens[1].size() < 34) {
+    return false;
   }
 
-  // Write the last line
-  fOut << corpusIdx << '\t' << join(wordList, ' ') << '\n';
+  mapTokens[0].erase(mapTokens[0].end() - 1);
+  mapTokens[1].erase(mapTokens[1].end() - 1);
+  wikipediaUrl = "http" + mapTokens[0].substr(6);
+  wikidataId = mapTokens[1].substr(32);
+  return true;
+}
+
+// Line format: <http://www.wikidata.org/entity/xxx>,"/m/xxx"
+bool parseFreebaseMapping(const string& line, string& freebaseId,
+    string& wikidataId) {
+  vector<string> mapTokens = tokenlize(line, ',');
+  if (mapTokens.size() != 2 ||
+      mapTokens[0].size() < 34 ||
+      mapTokens[1].size() < 4) {
+    return false;
+  }
+
+  mapTokens[0].erase(mapTokens[0].end() - 1);
+  mapTokens[1].erase(mapTokens[1].end() - 1);
+  wikidataId = mapTokens[0].substr(32);
+  freebaseId = mapTokens[1].substr(1);
+  return true;
+}
+
+/*
+ * Generate CoNLL-2003 IOB file with wikidata annotations for NER_NED.
+ *
+ * wikipedia_url of each entity can be obtained by aido-yago2-annotations,
+ * which can be further mapped to wikidata_id by the mapping file provided.
+ *
+ * Output: One corpus per line in the format of
+ * CORPUS_NO <TAB> WORD1\TAG1\[IOB] <SPACE> WORD2\TAG2\[IOB] <SPACE> ...
+ *
+ * Note: In the case of B, replace B by wikidata / wikipedia_url if exist.
+ */
+void genConllWikidataIOB(
+    const string& annotationFile, const vector<string>& datasetFiles,
+    const string& wikiMapFile, const string& freebaseMapFile,
+    const string& outFile) {
+  TRACE_SPAN("gen_conll_wikidata_iob");
+  ConllReader reader(annotationFile, datasetFiles);
+  std::ofstream fOut(outFile.c_str());
+
+  std::unordered_map<string, string> wikiMap;
+  std::unordered_map<string, string> freebaseMap;
+
+  cout << "\nLoading wikipedia url mapping file ...";
+  loadMapping(wikiMapFile, parseWikiMapping, wikiMap);
+
+  cout << "\nLoading freebase id mapping file ...";
+  loadMapping(freebaseMapFile, parseFreebaseMapping, freebaseMap);
+
+  Pipeline<Corpus>()
+    .source("read_corpus", [&](Corpus& corpus) {
+        return reader.next(corpus);
+      })
+    .transform("map_ids", [&](Corpus& corpus) {
+        for (ConllWord& word : corpus.words) {
+          if (!word.label.empty()) {
+            continue;
+          }
+          const vector<string>& annotTokens = word.annotTokens;
+          auto freebaseIt = annotTokens.size() >= 5 ?
+            freebaseMap.find(annotTokens[4]) : freebaseMap.end();
+          auto wikiIt = annotTokens.size() >= 3 ?
+            wikiMap.find(annotTokens[2]) : wikiMap.end();
+          if (freebaseIt != freebaseMap.end()) {
+            word.label = freebaseIt->second;
+          } else if (wikiIt != wikiMap.end()) {
+            word.label = wikiIt->second;
+          } else {
+            word.label = "B";
+          }
+        }
+      })
+    .transform("format_corpus", [](Corpus& corpus) {
+        vector<string> wordList;
+        for (ConllWord& word : corpus.words) {
+          // Handle &amp;
+          std::size_t pos = word.text.find("&amp;");
+          if (pos != string::npos) {
+            word.text = word.text.substr(0, pos+1) + word.text.substr(pos+5);
+          }
+          wordList.push_back(word.text + "\\?\\" + word.label);
+        }
+        corpus.output = std::to_string(corpus.corpusIdx) + '\t' +
+          (wordList.empty() ? "" : join(wordList, ' ')) + '\n';
+      })
+    .sink("write_output", [&](Corpus& corpus) { fOut << corpus.output; })
+    .run();
 
-  fAnnot.close();
-  fWikiMap.close();
-  fFreebaseMap.close();
   fOut.close();
 }
 
 int main(int argc, char** argv) {
-  if (argc < 5) {
+  startTrace(argc, argv);
+  setReadBackend(argc, argv);
+  vector<string> args = getPositionalArgs(argc, argv, {"--trace", "--io"});
+  if (args.size() < 4) {
     cout << "\nUsage: \n" <<
       "  gen_conll_wikidata_iob_main <dataset_dir> " <<
       "<wikipedia_url_map_file> <freebase_id_map_file> <output_dir>\n" <<
+      "    [ --trace <trace.json> ] [ --io <auto|uring|threads> ]\n" <<
       "\nDescription: \n" <<
       "  Generate the IOB ground truth of CoNLL-2003 dataset with " <<
       "wikidata annotations for NER_NED usage. \n\n" <<
@@ -202,23 +281,25 @@ int main(int argc, char** argv) {
       "    of line format <http://www.wikidata.org/entity/xxx>," <<
       "\"/m/xxx\"\n\n" <<
       "  <output_dir>\n" <<
-      "    Specify the directory you want to store the output.\n\n";
+      "    Specify the directory you want to store the output.\n\n" <<
+      TRACE_USAGE <<
+      IO_USAGE;
     return 1;
   }
 
   char outputPath[512] = "\0";
   snprintf(outputPath, sizeof(outputPath), "%s/%s",
-      argv[4], OUTPUT_FILE_NAME);
+      args[3].c_str(), OUTPUT_FILE_NAME);
   cout << "\nOutput path: " << outputPath << "\n";
 
-  string annotationFile = string(argv[1]) + "/" + INPUT_AIDA;
+  string annotationFile = args[0] + "/" + INPUT_AIDA;
   vector<string> datasetFiles = {
-    string(argv[1]) + "/" + INPUT_TRAIN,
-    string(argv[1]) + "/" + INPUT_TESTA,
-    string(argv[1]) + "/" + INPUT_TESTB
+    args[0] + "/" + INPUT_TRAIN,
+    args[0] + "/" + INPUT_TESTA,
+    args[0] + "/" + INPUT_TESTB
   };
   genConllWikidataIOB(
-      annotationFile, datasetFiles, argv[2], argv[3], outputPath);
+      annotationFile, datasetFiles, args[1], args[2], outputPath);
   cout << "\nDone!\n\n";
   return 0;
 }
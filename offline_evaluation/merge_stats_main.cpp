@@ -0,0 +1,275 @@
+// Copyright 2020, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Yi-Chun Lin <circle40191@gmail.com>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bootstrap.hpp"
+#include "eval_stats.hpp"
+#include "frames.hpp"
+#include "sketches.hpp"
+#include "trace.hpp"
+#include "utils.hpp"
+
+using std::cout;
+
+inline void appendFile(std::ostream& fOut, const string& inFile) {
+  std::ifstream fIn(inFile.c_str(), std::ios::binary);
+  if (fIn.peek() != std::ifstream::traits_type::eof()) {
+    fOut << fIn.rdbuf();
+  }
+  fIn.close();
+}
+
+/*
+ * Append the detail file name of dir to fOut. Compressed frames are copied
+ * as they are if fOut is compressed as well.
+ */
+inline void appendDetails(std::ostream& fOut, const string& dir,
+    const string& name) {
+  string framedFile = dir + "/" + name + FRAME_SUFFIX;
+  if (!hasFrameIndex(framedFile)) {
+    appendFile(fOut, dir + "/" + name);
+    return;
+  }
+
+  FrameReader fIn(framedFile);
+  if (!fIn.is_open()) {
+    cout << "Cannot read " << framedFile << ": its index is damaged or " <<
+      "does not match the file\n";
+    exit(1);
+  }
+  FrameWriter* fFrames = dynamic_cast<FrameWriter*>(&fOut);
+  if (fFrames != NULL) {
+    if (!fFrames->appendFrames(framedFile)) {
+      cout << "Cannot append " << framedFile << "\n";
+      exit(1);
+    }
+    return;
+  }
+
+  vector<char> buffer(FRAME_SIZE);
+  size_t n;
+  while ((n = fIn.read(buffer.data(), buffer.size())) > 0) {
+    fOut.write(buffer.data(), n);
+  }
+}
+
+/*
+ * Merge the partial results of evaluate_main --shard runs into one result
+ * folder, identical to evaluating the whole file on one node.
+ *
+ * Partials are ordered by their byte offset, so detail files and
+ * sentence_counts are concatenated in file order. The detail files are
+ * compressed if those of the first partial are. The bootstrap histograms
+ * are added up, so the confidence intervals are those of a single run.
+ * sentence_counts and the paired test are skipped unless every partial kept
+ * its counts, see --keep-counts of evaluate_main. The error mining sketches
+ * are merged, so error_mining is within the error bounds of its sketches
+ * but not identical to a single run.
+ */
+int mergeStats(const string& outputDir, const vector<string>& partialDirs,
+    const size_t bootstrapSamples, const string& pairedCountsFile) {
+  vector<std::pair<EvalPartial, string>> partials;
+
+  for (const string& dir : partialDirs) {
+    std::ifstream fPartial((dir + "/partial").c_str());
+    EvalPartial partial;
+    if (!readPartial(fPartial, partial)) {
+      cout << "Cannot read partial result in " << dir << "\n";
+      return 1;
+    }
+    partials.push_back(std::make_pair(partial, dir));
+  }
+
+  std::sort(partials.begin(), partials.end(),
+      [](const std::pair<EvalPartial, string>& a,
+        const std::pair<EvalPartial, string>& b) {
+        return a.first.beginOffset < b.first.beginOffset;
+      });
+
+  string statFile = outputDir + "/stat";
+  string partialFile = outputDir + "/partial";
+  bool compress = isFramed(partials[0].second + "/detail_ner" + FRAME_SUFFIX);
+  string detailSuffix = compress ? FRAME_SUFFIX : "";
+  string NerNedFile = outputDir + "/detail_ner_ned" + detailSuffix;
+  string NerFile = outputDir + "/detail_ner" + detailSuffix;
+  string countsFile = outputDir + "/sentence_counts";
+  std::unique_ptr<std::ostream> fNerNed = openOutput(NerNedFile, compress);
+  std::unique_ptr<std::ostream> fNer = openOutput(NerFile, compress);
+  size_t numCounts = 0;
+  for (const auto& elem : partials) {
+    std::ifstream fPartialCounts((elem.second + "/sentence_counts").c_str());
+    numCounts += fPartialCounts.is_open();
+  }
+  bool hasCounts = numCounts == partials.size();
+  if (!hasCounts && (numCounts > 0 || !pairedCountsFile.empty())) {
+    cout << "Warning: only " << numCounts << " of " << partials.size() <<
+      " partials have sentence_counts, the merged result has no " <<
+      "sentence_counts and no paired test\n";
+  }
+  std::ofstream fCounts;
+  if (hasCounts) {
+    fCounts.open(countsFile.c_str(), std::ios::binary);
+  } else {
+    unlink(countsFile.c_str());
+  }
+
+  EvalPartial merged = {EvalStats(), partials[0].first.algFilename,
+    partials[0].first.beginOffset, partials[0].first.beginOffset, 0};
+  std::unique_ptr<ErrorMining> mining;
+  bool hasMining = true;
+  Bootstrap histogram(false);
+  bool hasHistogram = true;
+
+  for (const auto& elem : partials) {
+    TRACE_SPAN("merge_partial");
+    const EvalPartial& partial = elem.first;
+    cout << "Merging " << elem.second << "\n";
+
+    if (partial.algFilename != merged.algFilename) {
+      cout << "Warning: " << elem.second << " evaluates " <<
+        partial.algFilename << " instead of " << merged.algFilename << "\n";
+    }
+
+    if (partial.beginOffset != merged.endOffset) {
+      cout << "Warning: bytes " << merged.endOffset << " to " <<
+        partial.beginOffset << " are not covered by any partial\n";
+    }
+
+    merged.stats.add(partial.stats);
+    merged.endOffset = partial.endOffset;
+    merged.durationSeconds = std::max(merged.durationSeconds,
+        partial.durationSeconds);
+
+    appendDetails(*fNerNed, elem.second, "detail_ner_ned");
+    appendDetails(*fNer, elem.second, "detail_ner");
+    if (hasCounts) {
+      appendFile(fCounts, elem.second + "/sentence_counts");
+    }
+
+    std::ifstream fSketches((elem.second + "/error_mining_sketches").c_str(),
+        std::ios::binary);
+    std::ifstream fHistogram((elem.second + "/bootstrap_histogram").c_str(),
+        std::ios::binary);
+    if (hasHistogram && !histogram.read(fHistogram)) {
+      cout << "Warning: cannot read " << elem.second <<
+        "/bootstrap_histogram, the merged result has no bootstrap\n";
+      hasHistogram = false;
+    }
+
+    ErrorMining partialMining(0);
+    if (!partialMining.read(fSketches)) {
+      cout << "Warning: cannot read " << elem.second <<
+        "/error_mining_sketches, the merged result has no error_mining\n";
+      hasMining = false;
+    } else if (mining && mining->topK != partialMining.topK) {
+      cout << "Warning: " << elem.second << " used --top-k " <<
+        partialMining.topK << " instead of " << mining->topK <<
+        ", the merged result has no error_mining\n";
+      hasMining = false;
+    } else if (!mining) {
+      mining.reset(new ErrorMining(partialMining));
+    } else {
+      mining->add(partialMining);
+    }
+  }
+
+  fCounts.close();
+
+  auto time1 = std::chrono::high_resolution_clock::now();
+  string bootstrap;
+  if (bootstrapSamples > 0 && hasHistogram) {
+    TRACE_SPAN("bootstrap");
+    histogram.run(bootstrapSamples, BOOTSTRAP_SEED);
+    bootstrap = bootstrapCIStats(bootstrapSamples,
+        histogram.microCI(0, CONFIDENCE_LEVEL),
+        histogram.macroCI(0, CONFIDENCE_LEVEL));
+  }
+  if (!pairedCountsFile.empty() && hasCounts) {
+    TRACE_SPAN("paired_bootstrap");
+    bootstrap += pairedBootstrapStats(countsFile, pairedCountsFile,
+        bootstrapSamples);
+  }
+  auto time2 = std::chrono::high_resolution_clock::now();
+
+  std::ofstream fStat(statFile.c_str());
+  writeStat(fStat, merged.stats, merged.durationSeconds,
+      getSeconds(time1, time2), merged.algFilename, getFileSize(*fNerNed),
+      getFileSize(*fNer), bootstrap);
+
+  // The merged partial can itself be merged again.
+  std::ofstream fPartial(partialFile.c_str());
+  writePartial(fPartial, merged);
+
+  if (hasHistogram) {
+    std::ofstream fHistogram((outputDir + "/bootstrap_histogram").c_str(),
+        std::ios::binary);
+    histogram.write(fHistogram);
+  } else {
+    unlink((outputDir + "/bootstrap_histogram").c_str());
+  }
+
+  if (hasMining && mining) {
+    std::ofstream fMining((outputDir + "/error_mining").c_str());
+    writeErrorMining(fMining, *mining);
+    std::ofstream fSketches((outputDir + "/error_mining_sketches").c_str(),
+        std::ios::binary);
+    mining->write(fSketches);
+  }
+
+  fStat.close();
+  fPartial.close();
+  fNerNed.reset();
+  fNer.reset();
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  startTrace(argc, argv);
+  vector<string> args = getPositionalArgs(argc, argv,
+      {"--bootstrap", "--paired", "--trace"});
+  if (args.size() < 2) {
+    cout << "\nUsage: \n" <<
+      "  merge_stats_main <output_dir> <partial_result_dir> ... " <<
+      "[ --bootstrap <n> ] [ --paired <other_result_dir> ]\n" <<
+      "    [ --trace <trace.json> ]\n" <<
+      "\nDescription: \n" <<
+      "  Merge the result folders of evaluate_main --shard runs into " <<
+      "one result folder with stat, detail_ner, detail_ner_ned and " <<
+      "error_mining.\n\n" <<
+      "  <output_dir>\n" <<
+      "    Result folder to create.\n\n" <<
+      "  <partial_result_dir> ...\n" <<
+      "    Result folders of the shards, in any order.\n\n" <<
+      "  --bootstrap <n> --paired <other_result_dir>\n" <<
+      "    Same as in evaluate_main.\n\n" <<
+      TRACE_USAGE;
+    return 1;
+  }
+
+  string outputDir = args[0];
+  if (mkdir(outputDir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1) {
+    if (errno != EEXIST) {
+        cout << "Cannot create result folder " << outputDir << "\n";
+        return 1;
+    }
+  }
+
+  string pairedDir = getOption(argc, argv, "--paired", "");
+  string pairedCountsFile = pairedDir.empty() ? "" :
+    pairedDir + "/sentence_counts";
+  size_t bootstrapSamples = getCountOption(argc, argv, "--bootstrap", 0);
+  if (!checkPaired(pairedCountsFile, bootstrapSamples)) {
+    return 1;
+  }
+
+  cout << "\nOutput path: " << outputDir << "\n";
+  int ret = mergeStats(outputDir,
+      vector<string>(args.begin() + 1, args.end()),
+      bootstrapSamples, pairedCountsFile);
+  if (ret == 0) {
+    cout << "\nDone!\n\n";
+  }
+  return ret;
+}
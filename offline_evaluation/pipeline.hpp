@@ -0,0 +1,218 @@
+// Copyright 2020, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Yi-Chun Lin <circle40191@gmail.com>
+
+#pragma once
+
+#include <atomic>
+#include <unordered_map>
+#include <functional>
+#include <memory>
+#include "async_reader.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+#include "utils.hpp"
+
+/*
+ * Streaming stages shared by the generators.
+ *
+ * A Pipeline reads items from a sequential source, runs the transforms on
+ * all cores and hands the items to the sinks in source order:
+ *
+ *   source -> transform -> ... -> transform -> sink -> ... -> sink
+ *
+ * Items are processed in batches. While the transforms run on one batch,
+ * the source already fills the next one. Sources and sinks run on the
+ * calling thread, so they may share state without locking; transforms must
+ * only touch their own item and read-only data.
+ *
+ * Each stage is traced under its name (see trace.hpp) and its time is
+ * reported at the end of run().
+ */
+
+const size_t PIPELINE_BATCH_SIZE = 100000;
+// Chunks per thread and batch, to balance uneven items.
+const size_t PIPELINE_CHUNKS_PER_THREAD = 4;
+
+template <typename T>
+class Pipeline {
+ public:
+  typedef std::function<bool(T&)> SourceFn;
+  typedef std::function<void(T&)> StageFn;
+
+  explicit Pipeline(size_t batchSize = PIPELINE_BATCH_SIZE)
+    : _batchSize(batchSize), _numThreads(ThreadPool::defaultSize()) {}
+
+  // Fill the next item and return true, or return false at the end.
+  Pipeline& source(const char* name, const SourceFn& fn) {
+    _source = fn;
+    addStage(name, "source");
+    return *this;
+  }
+
+  // Run on all cores, on the items of a batch in any order.
+  Pipeline& transform(const char* name, const StageFn& fn) {
+    _transforms.push_back(fn);
+    addStage(name, "transform");
+    return *this;
+  }
+
+  // Run on the calling thread, on the items in source order.
+  Pipeline& sink(const char* name, const StageFn& fn) {
+    _sinks.push_back(fn);
+    addStage(name, "sink");
+    return *this;
+  }
+
+  // Called after each batch with the number of items so far.
+  Pipeline& progress(const std::function<void(uint64_t)>& fn) {
+    _progress = fn;
+    return *this;
+  }
+
+  // Process all items and return their number.
+  uint64_t run() {
+    ThreadPool pool(_numThreads);
+    vector<T> batches[2] = {vector<T>(_batchSize), vector<T>(_batchSize)};
+    size_t sizes[2] = {0, 0};
+    bool more = true;
+    uint64_t numItems = 0;
+    int cur = 0;
+
+    sizes[cur] = fill(batches[cur], more);
+    while (sizes[cur] > 0) {
+      transformBatch(pool, batches[cur], sizes[cur]);
+      sizes[1 - cur] = more ? fill(batches[1 - cur], more) : 0;
+      pool.wait();
+
+      for (size_t s = 0; s < _sinks.size(); s++) {
+        Stage& stage = *_stages[1 + _transforms.size() + s];
+        TRACE_SPAN(stage.name);
+        auto time1 = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < sizes[cur]; i++) {
+          _sinks[s](batches[cur][i]);
+        }
+        stage.add(sizes[cur], time1);
+      }
+
+      numItems += sizes[cur];
+      if (_progress) {
+        _progress(numItems);
+      }
+      cur = 1 - cur;
+    }
+
+    printStats();
+    return numItems;
+  }
+
+ private:
+  struct Stage {
+    Stage(const char* name, const char* kind) : name(name), kind(kind),
+      numItems(0), nanos(0) {}
+
+    void add(uint64_t items, std::chrono::steady_clock::time_point start) {
+      numItems += items;
+      nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start).count();
+    }
+
+    const char* name;
+    const char* kind;
+    std::atomic<uint64_t> numItems;
+    std::atomic<uint64_t> nanos;
+  };
+
+  void addStage(const char* name, const char* kind) {
+    _stages.push_back(std::unique_ptr<Stage>(new Stage(name, kind)));
+  }
+
+  size_t fill(vector<T>& batch, bool& more) {
+    Stage& stage = *_stages[0];
+    TRACE_SPAN(stage.name);
+    auto time1 = std::chrono::steady_clock::now();
+    size_t n = 0;
+    for (; n < _batchSize; n++) {
+      batch[n] = T();
+      if (!_source(batch[n])) {
+        more = false;
+        break;
+      }
+    }
+    stage.add(n, time1);
+    return n;
+  }
+
+  void transformBatch(ThreadPool& pool, vector<T>& batch, size_t size) {
+    size_t numChunks = pool.size() * PIPELINE_CHUNKS_PER_THREAD;
+    size_t chunkSize = (size + numChunks - 1) / numChunks;
+    for (size_t begin = 0; begin < size && !_transforms.empty();
+        begin += chunkSize) {
+      size_t end = std::min(size, begin + chunkSize);
+      pool.submit([this, &batch, begin, end]() {
+        for (size_t t = 0; t < _transforms.size(); t++) {
+          Stage& stage = *_stages[1 + t];
+          TRACE_SPAN(stage.name);
+          auto time1 = std::chrono::steady_clock::now();
+          for (size_t i = begin; i < end; i++) {
+            _transforms[t](batch[i]);
+          }
+          stage.add(end - begin, time1);
+        }
+      });
+    }
+  }
+
+  void printStats() const {
+    std::cout << "\nStages (" << _numThreads << " threads):\n";
+    for (const auto& stage : _stages) {
+      printf("  %-20s %-10s %12lu items %10.2fs\n", stage->name, stage->kind,
+          stage->numItems.load(), stage->nanos.load() / 1e9);
+    }
+  }
+
+  size_t _batchSize;
+  size_t _numThreads;
+  SourceFn _source;
+  vector<StageFn> _transforms;
+  vector<StageFn> _sinks;
+  std::function<void(uint64_t)> _progress;
+  vector<std::unique_ptr<Stage>> _stages;
+};
+
+/*
+ * Source stage reading the lines of f.
+ */
+inline std::function<bool(string&)> lineSource(LineReader& f) {
+  return [&f](string& line) { return f.getline(line); };
+}
+
+/*
+ * Load a key-value mapping file with a Pipeline. parse extracts the pair of
+ * one line and returns false for lines to skip. Later lines win.
+ */
+inline void loadMapping(const string& mapFile,
+    const std::function<bool(const string&, string&, string&)>& parse,
+    std::unordered_map<string, string>& mapping) {
+  struct Entry {
+    string line;
+    string key;
+    string value;
+    bool valid;
+  };
+
+  LineReader fMap(mapFile);
+  auto readLine = lineSource(fMap);
+  Pipeline<Entry>()
+    .source("read_mapping", [&](Entry& e) { return readLine(e.line); })
+    .transform("parse_mapping", [&](Entry& e) {
+        e.valid = parse(e.line, e.key, e.value);
+      })
+    .sink("insert_mapping", [&](Entry& e) {
+        if (e.valid) {
+          mapping[e.key] = e.value;
+        }
+      })
+    .run();
+  fMap.close();
+}
@@ -0,0 +1,377 @@
+// Copyright 2020, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Yi-Chun Lin <circle40191@gmail.com>
+
+#pragma once
+
+#include <unordered_map>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include "utils.hpp"
+
+using std::to_string;
+
+const size_t TOP_K = 100;
+// Space-Saving keeps this many times more counters than reported.
+const size_t SPACE_SAVING_FACTOR = 10;
+const int HLL_PRECISION = 14;
+const char SKETCHES_MAGIC[] = "SKETCH01";
+
+/*
+ * Space-Saving (Metwally et al.): the most frequent keys of a stream in a
+ * fixed number of counters. A key not yet counted replaces the smallest
+ * counter and inherits its count as overestimation error, so every key with
+ * frequency above total / capacity is guaranteed to be kept.
+ */
+class SpaceSaving {
+ public:
+  struct Counter {
+    string key;
+    uint64_t count;
+    uint64_t error;
+  };
+
+  explicit SpaceSaving(size_t capacity) : _capacity(capacity), _total(0) {}
+
+  void add(const string& key) {
+    _total++;
+    auto it = _index.find(key);
+    if (it != _index.end()) {
+      _heap[it->second].count++;
+      siftDown(it->second);
+      return;
+    }
+
+    if (_heap.size() < _capacity) {
+      _heap.push_back({key, 1, 0});
+      _index[key] = _heap.size() - 1;
+      siftUp(_heap.size() - 1);
+      return;
+    }
+
+    // Replace the smallest counter, which is at the top of the heap.
+    Counter& smallest = _heap[0];
+    _index.erase(smallest.key);
+    smallest.key = key;
+    smallest.error = smallest.count;
+    smallest.count++;
+    _index[key] = 0;
+    siftDown(0);
+  }
+
+  /*
+   * Merge the counters of other (Agarwal et al., mergeable summaries). A key
+   * counted in only one sketch may have been evicted from the other one
+   * with up to its smallest count, which is added to count and error.
+   */
+  void add(const SpaceSaving& other) {
+    uint64_t minOwn = smallestCount();
+    uint64_t minOther = other.smallestCount();
+    std::unordered_map<string, Counter> merged;
+    for (const Counter& c : _heap) {
+      merged[c.key] = {c.key, c.count + minOther, c.error + minOther};
+    }
+    for (const Counter& c : other._heap) {
+      auto it = merged.find(c.key);
+      if (it == merged.end()) {
+        merged[c.key] = {c.key, c.count + minOwn, c.error + minOwn};
+      } else {
+        it->second.count += c.count - minOther;
+        it->second.error += c.error - minOther;
+      }
+    }
+
+    vector<Counter> counters;
+    for (const auto& elem : merged) {
+      counters.push_back(elem.second);
+    }
+    size_t k = std::min(_capacity, counters.size());
+    std::partial_sort(counters.begin(), counters.begin() + k, counters.end(),
+        [](const Counter& a, const Counter& b) {
+          return a.count > b.count || (a.count == b.count && a.key < b.key);
+        });
+    counters.resize(k);
+
+    // Ascending counts form a valid heap.
+    _heap.assign(counters.rbegin(), counters.rend());
+    _index.clear();
+    for (size_t i = 0; i < _heap.size(); i++) {
+      _index[_heap[i].key] = i;
+    }
+    _total += other._total;
+  }
+
+  uint64_t total() const { return _total; }
+
+  void write(std::ostream& f) const {
+    writeValue<uint64_t>(f, _capacity);
+    writeValue<uint64_t>(f, _total);
+    writeValue<uint64_t>(f, _heap.size());
+    for (const Counter& c : _heap) {
+      writeValue<uint64_t>(f, c.key.size());
+      f.write(c.key.data(), c.key.size());
+      writeValue(f, c.count);
+      writeValue(f, c.error);
+    }
+  }
+
+  // Read the counters written by write(), which must have the same
+  // capacity.
+  bool read(std::istream& f) {
+    uint64_t capacity, size;
+    if (!readValue(f, capacity) || capacity != _capacity ||
+        !readValue(f, _total) || !readValue(f, size) || size > _capacity) {
+      return false;
+    }
+    // The counters were written in heap order.
+    _heap.resize(size);
+    _index.clear();
+    for (size_t i = 0; i < size; i++) {
+      uint64_t keySize;
+      if (!readValue(f, keySize) || keySize > (1 << 20)) {
+        return false;
+      }
+      _heap[i].key.resize(keySize);
+      if (!f.read(&_heap[i].key[0], keySize) ||
+          !readValue(f, _heap[i].count) || !readValue(f, _heap[i].error)) {
+        return false;
+      }
+      _index[_heap[i].key] = i;
+    }
+    return true;
+  }
+
+  // The k largest counters, largest first.
+  vector<Counter> top(size_t k) const {
+    vector<Counter> counters(_heap);
+    k = std::min(k, counters.size());
+    std::partial_sort(counters.begin(), counters.begin() + k, counters.end(),
+        [](const Counter& a, const Counter& b) {
+          return a.count > b.count || (a.count == b.count && a.key < b.key);
+        });
+    counters.resize(k);
+    return counters;
+  }
+
+ private:
+  // Upper bound of the count of any key not in the sketch.
+  uint64_t smallestCount() const {
+    return _heap.size() < _capacity || _heap.empty() ? 0 : _heap[0].count;
+  }
+
+  void swapNodes(size_t a, size_t b) {
+    std::swap(_heap[a], _heap[b]);
+    _index[_heap[a].key] = a;
+    _index[_heap[b].key] = b;
+  }
+
+  void siftUp(size_t i) {
+    while (i > 0 && _heap[(i - 1) / 2].count > _heap[i].count) {
+      swapNodes(i, (i - 1) / 2);
+      i = (i - 1) / 2;
+    }
+  }
+
+  void siftDown(size_t i) {
+    while (true) {
+      size_t smallest = i;
+      for (size_t child = 2 * i + 1; child <= 2 * i + 2; child++) {
+        if (child < _heap.size() &&
+            _heap[child].count < _heap[smallest].count) {
+          smallest = child;
+        }
+      }
+      if (smallest == i) {
+        return;
+      }
+      swapNodes(i, smallest);
+      i = smallest;
+    }
+  }
+
+  size_t _capacity;
+  uint64_t _total;
+  vector<Counter> _heap;
+  std::unordered_map<string, size_t> _index;
+};
+
+/*
+ * HyperLogLog (Flajolet et al.): approximate number of distinct keys in
+ * 2^precision one-byte registers, with a standard error of about
+ * 1.04 / sqrt(2^precision), i.e. 0.8% for the default precision.
+ */
+class HyperLogLog {
+ public:
+  explicit HyperLogLog(int precision = HLL_PRECISION) : _precision(precision),
+    _registers(size_t(1) << precision, 0) {}
+
+  void add(const string& key) {
+    uint64_t hash = mix(std::hash<string>()(key));
+    size_t idx = hash >> (64 - _precision);
+    uint64_t rest = (hash << _precision) | (uint64_t(1) << (_precision - 1));
+    uint8_t rank = __builtin_clzll(rest) + 1;
+    _registers[idx] = std::max(_registers[idx], rank);
+  }
+
+  // Merge other, which must have the same precision.
+  void add(const HyperLogLog& other) {
+    for (size_t i = 0; i < _registers.size(); i++) {
+      _registers[i] = std::max(_registers[i], other._registers[i]);
+    }
+  }
+
+  void write(std::ostream& f) const {
+    writeValue<int32_t>(f, _precision);
+    f.write(reinterpret_cast<const char*>(_registers.data()),
+        _registers.size());
+  }
+
+  // Read the registers written by write(), which must have the same
+  // precision.
+  bool read(std::istream& f) {
+    int32_t precision;
+    return readValue(f, precision) && precision == _precision &&
+      f.read(reinterpret_cast<char*>(_registers.data()), _registers.size());
+  }
+
+  double estimate() const {
+    double m = _registers.size();
+    double sum = 0.0;
+    size_t zeros = 0;
+    for (uint8_t r : _registers) {
+      sum += std::ldexp(1.0, -r);
+      zeros += r == 0;
+    }
+    double estimate = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+    // Small range correction: linear counting.
+    if (estimate <= 2.5 * m && zeros > 0) {
+      estimate = m * std::log(m / zeros);
+    }
+    return estimate;
+  }
+
+ private:
+  // Finalizer of splitmix64, spreads the bits of std::hash evenly.
+  static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+  }
+
+  int _precision;
+  vector<uint8_t> _registers;
+};
+
+/*
+ * Most frequent InKB errors of one evaluation and the number of distinct
+ * entities, in memory independent of the corpus size.
+ */
+struct ErrorMining {
+  explicit ErrorMining(size_t topK) : topK(topK),
+    falsePositives(topK * SPACE_SAVING_FACTOR),
+    falseNegatives(topK * SPACE_SAVING_FACTOR),
+    confusions(topK * SPACE_SAVING_FACTOR) {}
+
+  size_t topK;
+  SpaceSaving falsePositives;   // Predicted ids which are wrong
+  SpaceSaving falseNegatives;   // Truth ids which are missed
+  SpaceSaving confusions;       // "truth_id alg_id" on the same span
+  HyperLogLog truthEntities;
+  HyperLogLog algEntities;
+  HyperLogLog falsePositiveIds;
+  HyperLogLog falseNegativeIds;
+
+  void add(const ErrorMining& other) {
+    falsePositives.add(other.falsePositives);
+    falseNegatives.add(other.falseNegatives);
+    confusions.add(other.confusions);
+    truthEntities.add(other.truthEntities);
+    algEntities.add(other.algEntities);
+    falsePositiveIds.add(other.falsePositiveIds);
+    falseNegativeIds.add(other.falseNegativeIds);
+  }
+
+  /*
+   * Dump the state of all sketches, so that the error mining of several
+   * evaluate_main --shard runs can be merged by merge_stats_main.
+   */
+  void write(std::ostream& f) const {
+    f.write(SKETCHES_MAGIC, sizeof(SKETCHES_MAGIC) - 1);
+    writeValue<uint64_t>(f, topK);
+    falsePositives.write(f);
+    falseNegatives.write(f);
+    confusions.write(f);
+    truthEntities.write(f);
+    algEntities.write(f);
+    falsePositiveIds.write(f);
+    falseNegativeIds.write(f);
+  }
+
+  // Replace this by the sketches written by write(). False if f is
+  // incomplete or no such dump.
+  bool read(std::istream& f) {
+    char magic[sizeof(SKETCHES_MAGIC) - 1];
+    uint64_t numTop;
+    if (!f.read(magic, sizeof(magic)) ||
+        memcmp(magic, SKETCHES_MAGIC, sizeof(magic)) != 0 ||
+        !readValue(f, numTop)) {
+      return false;
+    }
+    *this = ErrorMining(numTop);
+    return falsePositives.read(f) && falseNegatives.read(f) &&
+      confusions.read(f) && truthEntities.read(f) && algEntities.read(f) &&
+      falsePositiveIds.read(f) && falseNegativeIds.read(f);
+  }
+};
+
+inline void writeTopCounters(std::ofstream& f, const string& name,
+    const SpaceSaving& sketch, size_t topK, bool last) {
+  vector<SpaceSaving::Counter> counters = sketch.top(topK);
+  f << "  \"" << name << "\": [\n";
+  for (size_t i = 0; i < counters.size(); i++) {
+    const SpaceSaving::Counter& c = counters[i];
+    std::size_t pos = c.key.find(' ');
+    f << "    {";
+    if (pos == string::npos) {
+      f << "\"id\": \"" << c.key << "\"";
+    } else {
+      f << "\"truth_id\": \"" << c.key.substr(0, pos) << "\", " <<
+        "\"alg_id\": \"" << c.key.substr(pos + 1) << "\"";
+    }
+    f << ", \"count\": " << c.count << ", \"max_overcount\": " << c.error <<
+      "}" << (i + 1 < counters.size() ? "," : "") << "\n";
+  }
+  f << "  ]" << (last ? "" : ",") << "\n";
+}
+
+/*
+ * Write the error_mining file. Counts of listed keys are upper bounds,
+ * at most max_overcount above the true count.
+ */
+inline void writeErrorMining(std::ofstream& f, const ErrorMining& mining) {
+  f << "{\n";
+  f << printStat("top_k", to_string(mining.topK));
+  f << printStat("num_false_positives",
+      to_string(mining.falsePositives.total()));
+  f << printStat("num_false_negatives",
+      to_string(mining.falseNegatives.total()));
+  f << printStat("num_confusions", to_string(mining.confusions.total()));
+  f << printStat("distinct_truth_entities",
+      to_string(std::llround(mining.truthEntities.estimate())));
+  f << printStat("distinct_alg_entities",
+      to_string(std::llround(mining.algEntities.estimate())));
+  f << printStat("distinct_false_positive_ids",
+      to_string(std::llround(mining.falsePositiveIds.estimate())));
+  f << printStat("distinct_false_negative_ids",
+      to_string(std::llround(mining.falseNegativeIds.estimate())));
+  writeTopCounters(f, "false_positives", mining.falsePositives, mining.topK,
+      false);
+  writeTopCounters(f, "false_negatives", mining.falseNegatives, mining.topK,
+      false);
+  writeTopCounters(f, "confusions", mining.confusions, mining.topK, true);
+  f << "}\n";
+}
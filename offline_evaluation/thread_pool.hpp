@@ -0,0 +1,88 @@
+// Copyright 2020, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Yi-Chun Lin <circle40191@gmail.com>
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "utils.hpp"
+
+/*
+ * Fixed set of worker threads running tasks from a queue.
+ */
+class ThreadPool {
+ public:
+  explicit ThreadPool(size_t numThreads) : _numPending(0), _stop(false) {
+    for (size_t t = 0; t < numThreads; t++) {
+      _workers.push_back(std::thread([this]() { work(); }));
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+    _taskReady.notify_all();
+    for (auto& worker : _workers) {
+      worker.join();
+    }
+  }
+
+  size_t size() const { return _workers.size(); }
+
+  void submit(const std::function<void()>& task) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _tasks.push_back(task);
+      _numPending++;
+    }
+    _taskReady.notify_one();
+  }
+
+  // Block until all submitted tasks are done.
+  void wait() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _allDone.wait(lock, [this]() { return _numPending == 0; });
+  }
+
+  static size_t defaultSize() {
+    size_t numThreads = std::thread::hardware_concurrency();
+    return numThreads == 0 ? 1 : numThreads;
+  }
+
+ private:
+  void work() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _taskReady.wait(lock, [this]() { return _stop || !_tasks.empty(); });
+        if (_stop) {
+          return;
+        }
+        task = _tasks.front();
+        _tasks.pop_front();
+      }
+
+      task();
+
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (--_numPending == 0) {
+        _allDone.notify_all();
+      }
+    }
+  }
+
+  size_t _numPending;
+  bool _stop;
+  std::mutex _mutex;
+  std::condition_variable _taskReady;
+  std::condition_variable _allDone;
+  std::deque<std::function<void()>> _tasks;
+  vector<std::thread> _workers;
+};
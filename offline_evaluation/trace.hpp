@@ -0,0 +1,229 @@
+// Copyright 2020, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Yi-Chun Lin <circle40191@gmail.com>
+
+#pragma once
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include "utils.hpp"
+
+/*
+ * Lightweight tracing of the hot phases of all tools.
+ *
+ * Wrap a phase in TRACE_SPAN("name"). Unless tracing was started with
+ * --trace <file>, a span only costs one predictable branch, so production
+ * binaries are always built with tracing. Building with -DNO_TRACE removes
+ * the spans completely.
+ *
+ * Each span records wall-clock time and, where perf_event_open is permitted,
+ * the user-space cycles, instructions and cache misses of its thread. At exit
+ * all spans are written in Chrome trace format, to be opened in
+ * chrome://tracing or https://ui.perfetto.dev.
+ */
+
+const int PERF_NUM_COUNTERS = 3;
+const char* const PERF_COUNTER_NAMES[PERF_NUM_COUNTERS] = {
+  "cycles", "instructions", "cache_misses"
+};
+
+/*
+ * Hardware counters of the calling thread, opened as one perf event group.
+ */
+class PerfCounters {
+ public:
+  PerfCounters() : _leader(-1) {
+    const uint64_t configs[PERF_NUM_COUNTERS] = {
+      PERF_COUNT_HW_CPU_CYCLES,
+      PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_MISSES
+    };
+
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.config = configs[i];
+      attr.disabled = i == 0;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP;
+
+      int fd = syscall(__NR_perf_event_open, &attr, 0, -1, _leader, 0);
+      if (fd == -1) {
+        close();
+        return;
+      }
+      _fds.push_back(fd);
+      _leader = i == 0 ? fd : _leader;
+    }
+
+    ioctl(_leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+
+  ~PerfCounters() { close(); }
+
+  bool available() const { return _leader != -1; }
+
+  bool read(uint64_t* values) const {
+    uint64_t buffer[PERF_NUM_COUNTERS + 1];
+    if (!available() ||
+        ::read(_leader, buffer, sizeof(buffer)) != sizeof(buffer)) {
+      return false;
+    }
+    memcpy(values, buffer + 1, sizeof(uint64_t) * PERF_NUM_COUNTERS);
+    return true;
+  }
+
+  // One instance per thread, opened on first use.
+  static const PerfCounters& local() {
+    static thread_local PerfCounters counters;
+    return counters;
+  }
+
+ private:
+  void close() {
+    for (int fd : _fds) {
+      ::close(fd);
+    }
+    _fds.clear();
+    _leader = -1;
+  }
+
+  vector<int> _fds;
+  int _leader;
+};
+
+class Tracer {
+ public:
+  struct Event {
+    const char* name;
+    uint64_t startUs;
+    uint64_t durationUs;
+    uint64_t threadId;
+    bool hasCounters;
+    uint64_t counters[PERF_NUM_COUNTERS];
+  };
+
+  static Tracer& instance() {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  static bool enabled() { return instance()._enabled.load(); }
+
+  void start(const string& traceFile) {
+    _traceFile = traceFile;
+    _start = std::chrono::steady_clock::now();
+    _enabled = !traceFile.empty();
+  }
+
+  uint64_t nowUs() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - _start).count();
+  }
+
+  void record(const Event& event) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _events.push_back(event);
+  }
+
+  // Write all recorded spans in Chrome trace format.
+  void write() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_enabled) {
+      return;
+    }
+
+    std::ofstream f(_traceFile.c_str());
+    f << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    for (size_t i = 0; i < _events.size(); i++) {
+      const Event& e = _events[i];
+      f << "  {\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": " <<
+        getpid() << ", \"tid\": " << e.threadId << ", \"ts\": " <<
+        e.startUs << ", \"dur\": " << e.durationUs << ", \"args\": {";
+      for (int c = 0; e.hasCounters && c < PERF_NUM_COUNTERS; c++) {
+        f << (c > 0 ? ", " : "") << "\"" << PERF_COUNTER_NAMES[c] <<
+          "\": " << e.counters[c];
+      }
+      f << "}}" << (i + 1 < _events.size() ? "," : "") << "\n";
+    }
+    f << "]}\n";
+    f.close();
+
+    std::cout << "Trace written to " << _traceFile << "\n";
+    _enabled = false;
+  }
+
+  ~Tracer() { write(); }
+
+ private:
+  Tracer() : _enabled(false) {}
+
+  std::atomic<bool> _enabled;
+  string _traceFile;
+  std::chrono::steady_clock::time_point _start;
+  std::mutex _mutex;
+  vector<Event> _events;
+};
+
+/*
+ * Record the lifetime of this object as one span.
+ */
+class TraceSpan {
+ public:
+  explicit TraceSpan(const char* name) : _active(Tracer::enabled()) {
+    if (!_active) {
+      return;
+    }
+    _event.name = name;
+    _event.threadId = syscall(SYS_gettid);
+    _event.hasCounters = PerfCounters::local().read(_event.counters);
+    _event.startUs = Tracer::instance().nowUs();
+  }
+
+  ~TraceSpan() {
+    if (!_active) {
+      return;
+    }
+    uint64_t endCounters[PERF_NUM_COUNTERS];
+    _event.durationUs = Tracer::instance().nowUs() - _event.startUs;
+    if (_event.hasCounters && PerfCounters::local().read(endCounters)) {
+      for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+        _event.counters[c] = endCounters[c] - _event.counters[c];
+      }
+    } else {
+      _event.hasCounters = false;
+    }
+    Tracer::instance().record(_event);
+  }
+
+ private:
+  bool _active;
+  Tracer::Event _event;
+};
+
+#define TRACE_USAGE \
+  "  --trace <trace.json>\n" \
+  "    Record the time and hardware counters of the main phases in " \
+  "Chrome trace format.\n\n"
+
+inline void startTrace(int argc, char** argv) {
+  Tracer::instance().start(getOption(argc, argv, "--trace", ""));
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#ifdef NO_TRACE
+#define TRACE_SPAN(name)
+#else
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name)
+#endif
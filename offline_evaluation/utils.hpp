@@ -2,6 +2,8 @@
 // Chair of Algorithms and Data Structures.
 // Yi-Chun Lin <circle40191@gmail.com>
 
+#pragma once
+
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -11,6 +13,8 @@
 #include <algorithm>
 #include <chrono>
 #include <ctime>
+#include <cstdlib>
+#include <stdexcept>
 
 using std::string;
 using std::vector;
@@ -50,18 +54,21 @@ inline string lowercase(const string orig) {
   return lower;
 }
 
+inline void printPercent(const uint64_t cur, const uint64_t total) {
+  double percent = cur * 100.0 / total;
+  printf("Processing... %.1f%s\r", percent, "%");
+  fflush(stdout);
+}
+
 inline void printProgress(const uint64_t cur, const uint64_t total) {
   uint64_t freq = total / 1000 + 1;
   if (cur % freq != 0) {
     return;
   }
-
-  double percent = cur * 100.0 / total;
-  printf("Processing... %.1f%s\r", percent, "%");
-  fflush(stdout);
+  printPercent(cur, total);
 }
 
-string getDate() {
+inline string getDate() {
     auto now = std::chrono::system_clock::now();
     auto in_time_t = std::chrono::system_clock::to_time_t(now);
 
@@ -70,16 +77,24 @@ string getDate() {
     return ss.str();
 }
 
-inline string getDuration(
+inline size_t getSeconds(
     const std::chrono::high_resolution_clock::time_point& t1,
     const std::chrono::high_resolution_clock::time_point& t2) {
-  size_t time = std::chrono::duration_cast<std::chrono::seconds>
-    (t2 - t1).count();
+  return std::chrono::duration_cast<std::chrono::seconds>(t2 - t1).count();
+}
+
+inline string getDuration(const size_t time) {
   std::stringstream ss;
   ss << time / 3600 << "h " << (time % 3600) / 60 << "m " << time % 60 << "s";
   return ss.str();
 }
 
+inline string getDuration(
+    const std::chrono::high_resolution_clock::time_point& t1,
+    const std::chrono::high_resolution_clock::time_point& t2) {
+  return getDuration(getSeconds(t1, t2));
+}
+
 inline string printStat(const string& key, const string& value) {
   std::stringstream ss;
   ss << "  \"" << key << "\": \"" << value << "\",\n";
@@ -94,7 +109,7 @@ inline string getFileSize(std::ifstream& f) {
   return to_string(f.tellg());
 }
 
-inline string getFileSize(std::ofstream& f) {
+inline string getFileSize(std::ostream& f) {
   if (f.tellp() == -1) {
     f.clear();
     f.seekp(0, f.end);
@@ -106,3 +121,78 @@ inline string getFileName(const string& f) {
   auto index = fields.size() - 1;
   return fields[index];
 }
+
+inline bool hasOption(int argc, char** argv, const string& flag) {
+  for (int i = 1; i < argc; i++) {
+    if (flag == argv[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+inline string getOption(int argc, char** argv, const string& flag,
+    const string& defaultValue) {
+  for (int i = 1; i < argc - 1; i++) {
+    if (flag == argv[i]) {
+      return argv[i + 1];
+    }
+  }
+  return defaultValue;
+}
+
+// Parse the integer value of option flag, at least minValue, or exit with an
+// error instead of throwing.
+inline uint64_t parseCount(const string& value, const string& flag,
+    const uint64_t minValue = 0) {
+  size_t end = 0;
+  uint64_t count = 0;
+  if (!value.empty() && value[0] >= '0' && value[0] <= '9') {
+    try {
+      count = std::stoull(value, &end);
+    } catch (const std::exception&) {
+      end = 0;
+    }
+  }
+  if (end == 0 || end != value.size() || count < minValue) {
+    std::cout << "Invalid value \"" << value << "\" for " << flag << "\n";
+    exit(1);
+  }
+  return count;
+}
+
+inline uint64_t getCountOption(int argc, char** argv, const string& flag,
+    const uint64_t defaultValue, const uint64_t minValue = 0) {
+  return parseCount(getOption(argc, argv, flag, std::to_string(defaultValue)),
+      flag, minValue);
+}
+
+// Return the arguments which are neither options nor values of the options
+// listed in valueOptions.
+inline vector<string> getPositionalArgs(int argc, char** argv,
+    const vector<string>& valueOptions) {
+  vector<string> args;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg.substr(0, 2) != "--") {
+      args.push_back(arg);
+    } else if (std::find(valueOptions.begin(), valueOptions.end(), arg) !=
+        valueOptions.end()) {
+      i++;
+    }
+  }
+  return args;
+}
+
+// Values of the binary dumps, see ErrorMining::write() and
+// Bootstrap::write().
+template <typename T>
+inline void writeValue(std::ostream& f, const T value) {
+  f.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+inline bool readValue(std::istream& f, T& value) {
+  return static_cast<bool>(
+      f.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
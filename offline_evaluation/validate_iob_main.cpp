@@ -0,0 +1,584 @@
+// Copyright 2020, University of Freiburg,
+// Chair of Algorithms and Data Structures.
+// Yi-Chun Lin <circle40191@gmail.com>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "async_reader.hpp"
+#include "evaluator.h"
+#include "frames.hpp"
+#include "pipeline.hpp"
+#include "trace.hpp"
+#include "utils.hpp"
+
+using std::cout;
+
+// Bytes of whole lines checked by one task.
+const size_t VALIDATE_CHUNK_SIZE = 4 << 20;
+const size_t VALIDATE_MAX_REPORT = 100;
+const size_t EXCERPT_SIZE = 40;
+
+enum IobFormat { FORMAT_TRUTH, FORMAT_ALG, FORMAT_DOCS, FORMAT_WORDS };
+
+// Lines violating a rule marked drop are left out of a repaired file, the
+// others are fixed, except for LINE_NO_ORDER which is only reported.
+enum ViolationKind {
+  BAD_LINE_NO, MISSING_FIELD, EXTRA_FIELD, EMPTY_WORD, SHORT_WORD, LONG_WORD,
+  SPACE_IN_WORD, BAD_ENTITY_FLAG, LINE_NO_ORDER, NUM_KINDS
+};
+
+const char* KIND_NAMES[NUM_KINDS] = {
+  "LINE_NO is not a number",
+  "missing tab field",
+  "too many tab fields",
+  "empty word",
+  "word with fewer than three \\ fields",
+  "word with more than three \\ fields",
+  "space in word",
+  "entity flag is not 0 or 1",
+  "LINE_NO out of order",
+};
+
+const bool KIND_DROPS[NUM_KINDS] = {
+  true, true, false, false, false, true, false, true, false
+};
+
+// One reported violation. line and offset are relative to the chunk until
+// the sink adds the position of the chunk.
+struct Violation {
+  uint64_t line;
+  uint64_t offset;
+  uint64_t column;
+  ViolationKind kind;
+  string excerpt;
+};
+
+/*
+ * A block of whole lines of the input. data points into the mapped file or
+ * into buffer.
+ */
+struct Chunk {
+  uint64_t offset;
+  const char* data;
+  size_t size;
+  string buffer;
+
+  uint64_t numLines;
+  uint64_t numBadLines;
+  uint64_t numDropped;
+  uint64_t numRepaired;
+  uint64_t counts[NUM_KINDS];
+  vector<Violation> violations;
+  // LINE_NO of the first and last line with a valid one, to check the order
+  // across chunks.
+  bool hasLineNo;
+  uint64_t firstLineNo;
+  uint64_t lastLineNo;
+  Violation firstLine;
+  bool firstLineBad;
+  // With repair, the repaired lines if any line needed a repair.
+  bool repaired;
+  string output;
+};
+
+// The violations of the line being checked, with the first column of each.
+struct LineCheck {
+  unsigned int kinds;
+  uint64_t columns[NUM_KINDS];
+  StrView excerpts[NUM_KINDS];
+
+  void add(ViolationKind kind, const char* lineBegin, const StrView& at) {
+    if (!(kinds & (1u << kind))) {
+      kinds |= 1u << kind;
+      columns[kind] = at.data - lineBegin;
+      excerpts[kind] = at;
+    }
+  }
+};
+
+size_t minFields(const IobFormat format) {
+  return format == FORMAT_ALG || format == FORMAT_WORDS ? 3 : 2;
+}
+
+size_t maxFields(const IobFormat format) {
+  return format == FORMAT_ALG ? 3 : format == FORMAT_WORDS ? 4 : 2;
+}
+
+size_t lineNoField(const IobFormat format) {
+  return format == FORMAT_WORDS ? 2 : 0;
+}
+
+bool isSentenceField(const IobFormat format, const size_t i) {
+  return (format == FORMAT_TRUTH || format == FORMAT_ALG) && i > 0;
+}
+
+bool isBlank(const StrView& s) {
+  for (size_t i = 0; i < s.size; i++) {
+    if (s.data[i] != ' ') {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Parse a LINE_NO of at most 19 digits.
+bool parseLineNo(const StrView& field, uint64_t& lineNo) {
+  if (field.size == 0 || field.size > 19) {
+    return false;
+  }
+  lineNo = 0;
+  for (size_t i = 0; i < field.size; i++) {
+    if (field.data[i] < '0' || field.data[i] > '9') {
+      return false;
+    }
+    lineNo = lineNo * 10 + (field.data[i] - '0');
+  }
+  return true;
+}
+
+// Split [begin, end) at del into at most maxParts parts, the last one
+// keeping the rest. Returns the number of parts.
+size_t split(const char* begin, const char* end, const char del,
+    StrView* parts, const size_t maxParts) {
+  size_t n = 0;
+  while (n + 1 < maxParts) {
+    const void* pos = memchr(begin, del, end - begin);
+    if (pos == NULL) {
+      break;
+    }
+    const char* fieldEnd = static_cast<const char*>(pos);
+    parts[n++] = StrView(begin, fieldEnd - begin);
+    begin = fieldEnd + 1;
+  }
+  parts[n++] = StrView(begin, end - begin);
+  return n;
+}
+
+/*
+ * Check the words WORD\TAG\LABEL of an IOB sentence. A word is short if it
+ * has fewer than two backslashes or an empty label, which is how the words
+ * of "New York\?\O" look when a stray space splits them.
+ */
+void checkSentence(const StrView& sentence, const char* lineBegin,
+    LineCheck& check) {
+  const char* end = sentence.data + sentence.size;
+  if (sentence.size == 0) {
+    return;
+  }
+  // One pass over the bytes, counting the backslashes of each word.
+  const char* wordBegin = sentence.data;
+  int numSlashes = 0;
+  for (const char* p = sentence.data; ; p++) {
+    if (p != end && *p != ' ') {
+      numSlashes += *p == '\\';
+      continue;
+    }
+    StrView word(wordBegin, p - wordBegin);
+    if (word.size == 0) {
+      check.add(EMPTY_WORD, lineBegin, word);
+    } else if (numSlashes < 2 || (numSlashes == 2 && p[-1] == '\\')) {
+      check.add(SHORT_WORD, lineBegin, word);
+    } else if (numSlashes > 2) {
+      check.add(LONG_WORD, lineBegin, word);
+    }
+    if (p == end) {
+      break;
+    }
+    wordBegin = p + 1;
+    numSlashes = 0;
+  }
+}
+
+// Append the words of sentence, dropping empty words and completing short
+// ones with the "?" tag and the "O" label, as the evaluation reads them.
+void repairSentence(const StrView& sentence, string& out) {
+  const char* end = sentence.data + sentence.size;
+  const char* begin = sentence.data;
+  bool first = true;
+  while (begin < end) {
+    const void* pos = memchr(begin, ' ', end - begin);
+    const char* wordEnd = pos == NULL ? end : static_cast<const char*>(pos);
+    if (wordEnd != begin) {
+      StrView parts[3];
+      size_t numParts = split(begin, wordEnd, '\\', parts, 3);
+      if (!first) {
+        out += ' ';
+      }
+      first = false;
+      out.append(begin, wordEnd - begin);
+      if (numParts == 1) {
+        out += "\\?\\O";
+      } else if (numParts == 2) {
+        out += "\\O";
+      } else if (parts[2].size == 0) {
+        out += 'O';
+      }
+    }
+    begin = wordEnd + 1;
+  }
+}
+
+/*
+ * Check the line [begin, end) without its '\n', at the chunk offset offset.
+ * With repair, the line or its repair is appended to chunk.output once the
+ * first line of the chunk needed a repair.
+ */
+void checkLine(const char* begin, const char* end, const uint64_t offset,
+    const IobFormat format, const size_t maxReport, const bool repair,
+    Chunk& chunk) {
+  LineCheck check;
+  check.kinds = 0;
+  StrView fields[5];
+  size_t numFields = split(begin, end, '\t', fields, maxFields(format) + 1);
+
+  if (numFields < minFields(format)) {
+    check.add(MISSING_FIELD, begin, StrView(begin, end - begin));
+  } else if (numFields > maxFields(format)) {
+    check.add(EXTRA_FIELD, begin, fields[numFields - 1]);
+    numFields--;
+  }
+
+  uint64_t lineNo = 0;
+  size_t noField = lineNoField(format);
+  bool hasLineNo = numFields > noField &&
+    parseLineNo(fields[noField], lineNo);
+  if (!hasLineNo && numFields > noField) {
+    check.add(BAD_LINE_NO, begin, fields[noField]);
+  }
+
+  for (size_t i = 0; i < numFields; i++) {
+    if (isSentenceField(format, i)) {
+      checkSentence(fields[i], begin, check);
+    }
+  }
+
+  if (format == FORMAT_WORDS && numFields > 0) {
+    if (isBlank(fields[0])) {
+      check.add(EMPTY_WORD, begin, fields[0]);
+    } else if (memchr(fields[0].data, ' ', fields[0].size) != NULL) {
+      check.add(SPACE_IN_WORD, begin, fields[0]);
+    }
+    if (numFields > 1 && !(fields[1].size == 1 &&
+          (fields[1].data[0] == '0' || fields[1].data[0] == '1'))) {
+      check.add(BAD_ENTITY_FLAG, begin, fields[1]);
+    }
+  }
+
+  // quickSeek needs the LINE_NO of the generator inputs in order.
+  if (hasLineNo && (format == FORMAT_DOCS || format == FORMAT_WORDS)) {
+    if (!chunk.hasLineNo) {
+      chunk.hasLineNo = true;
+      chunk.firstLineNo = lineNo;
+      chunk.firstLine = {chunk.numLines, offset,
+        static_cast<uint64_t>(fields[noField].data - begin), LINE_NO_ORDER,
+        fields[noField].str()};
+      chunk.firstLineBad = check.kinds != 0;
+    } else if (lineNo < chunk.lastLineNo ||
+        (lineNo == chunk.lastLineNo && format == FORMAT_DOCS)) {
+      check.add(LINE_NO_ORDER, begin, fields[noField]);
+    }
+    chunk.lastLineNo = lineNo;
+  }
+
+  // A blank word of a wordsfile leaves nothing to repair.
+  bool drop = format == FORMAT_WORDS && (check.kinds & (1u << EMPTY_WORD));
+  for (int k = 0; k < NUM_KINDS; k++) {
+    if (!(check.kinds & (1u << k))) {
+      continue;
+    }
+    chunk.counts[k]++;
+    drop = drop || KIND_DROPS[k];
+    if (chunk.violations.size() < maxReport) {
+      const StrView& at = check.excerpts[k];
+      chunk.violations.push_back({chunk.numLines, offset, check.columns[k],
+          static_cast<ViolationKind>(k),
+          string(at.data, std::min(at.size, EXCERPT_SIZE))});
+    }
+  }
+  chunk.numLines++;
+  chunk.numBadLines += check.kinds != 0;
+  chunk.numDropped += drop;
+  bool needsRepair = (check.kinds & ~(1u << LINE_NO_ORDER)) != 0;
+  chunk.numRepaired += needsRepair && !drop;
+
+  if (!repair) {
+    return;
+  }
+  if (needsRepair && !chunk.repaired) {
+    chunk.repaired = true;
+    chunk.output.assign(chunk.data, begin - chunk.data);
+  }
+  if (!chunk.repaired || drop) {
+    return;
+  }
+  if (!needsRepair) {
+    chunk.output.append(begin, end - begin);
+    chunk.output += '\n';
+    return;
+  }
+
+  if (format == FORMAT_WORDS) {
+    // One line per word, as gen_clueweb_freebase_iob_main splits them.
+    string rest;
+    for (size_t i = 1; i < numFields; i++) {
+      rest += '\t';
+      rest.append(fields[i].data, fields[i].size);
+    }
+    const char* wordsEnd = fields[0].data + fields[0].size;
+    for (const char* word = fields[0].data; word < wordsEnd; ) {
+      const void* pos = memchr(word, ' ', wordsEnd - word);
+      const char* wordEnd = pos == NULL ? wordsEnd :
+        static_cast<const char*>(pos);
+      if (wordEnd != word) {
+        chunk.output.append(word, wordEnd - word);
+        chunk.output += rest;
+        chunk.output += '\n';
+      }
+      word = wordEnd + 1;
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < numFields; i++) {
+    if (i > 0) {
+      chunk.output += '\t';
+    }
+    if (isSentenceField(format, i)) {
+      repairSentence(fields[i], chunk.output);
+    } else {
+      chunk.output.append(fields[i].data, fields[i].size);
+    }
+  }
+  chunk.output += '\n';
+}
+
+// Check all lines of a chunk.
+void checkChunk(Chunk& chunk, const IobFormat format, const size_t maxReport,
+    const bool repair) {
+  chunk.numLines = chunk.numBadLines = chunk.numDropped = 0;
+  chunk.numRepaired = 0;
+  memset(chunk.counts, 0, sizeof(chunk.counts));
+  chunk.hasLineNo = false;
+  chunk.repaired = false;
+  const char* end = chunk.data + chunk.size;
+  for (const char* begin = chunk.data; begin < end; ) {
+    const void* pos = memchr(begin, '\n', end - begin);
+    const char* lineEnd = pos == NULL ? end : static_cast<const char*>(pos);
+    checkLine(begin, lineEnd, begin - chunk.data, format, maxReport, repair,
+        chunk);
+    begin = lineEnd + 1;
+  }
+}
+
+/*
+ * Map a plain file into memory. Returns NULL for pipes, compressed files
+ * and empty files, which are read with a LineReader instead.
+ */
+const char* mapFile(const string& filename, uint64_t& size) {
+  if (filename == "-" || isPipe(filename) || hasFrameIndex(filename)) {
+    return NULL;
+  }
+  int fd = open(filename.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+  size = st.st_size;
+  void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+  return static_cast<const char*>(data);
+}
+
+/*
+ * Check every line of inFile against the format and print the violations,
+ * at most maxReport of them. With a non-empty repairFile, the lines are also
+ * written there, repaired or dropped. Returns the number of violating lines.
+ *
+ * Plain files are mapped and checked in chunks of VALIDATE_CHUNK_SIZE bytes
+ * on all cores; pipes and compressed files are read into such chunks first.
+ */
+uint64_t validateIOB(const string& inFile, const IobFormat format,
+    const size_t maxReport, const string& repairFile, const bool compress) {
+  uint64_t mappedSize = 0;
+  const char* mapped = mapFile(inFile, mappedSize);
+  std::unique_ptr<LineReader> fIn;
+  if (mapped == NULL) {
+    fIn.reset(new LineReader(inFile));
+    if (!fIn->is_open()) {
+      cout << "Cannot open " << inFile << "\n";
+      exit(1);
+    }
+  }
+  uint64_t fileSize = mapped != NULL ? mappedSize : fIn->size();
+  bool repair = !repairFile.empty();
+  std::unique_ptr<std::ostream> fOut;
+  if (repair) {
+    fOut = openOutput(repairFile, compress);
+  }
+
+  uint64_t offset = 0;
+  uint64_t numLines = 0;
+  uint64_t numBadLines = 0;
+  uint64_t numDropped = 0;
+  uint64_t numRepaired = 0;
+  uint64_t counts[NUM_KINDS] = {0};
+  size_t numReported = 0;
+  bool hasLineNo = false;
+  uint64_t lastLineNo = 0;
+  string line;
+
+  Pipeline<Chunk>(ThreadPool::defaultSize())
+    .source("read_chunks", [&](Chunk& chunk) {
+        chunk.offset = offset;
+        if (mapped != NULL) {
+          if (offset >= mappedSize) {
+            return false;
+          }
+          uint64_t end = std::min(offset + VALIDATE_CHUNK_SIZE, mappedSize);
+          const void* pos = memchr(mapped + end, '\n', mappedSize - end);
+          end = pos == NULL ? mappedSize :
+            static_cast<const char*>(pos) - mapped + 1;
+          chunk.data = mapped + offset;
+          chunk.size = end - offset;
+        } else {
+          while (chunk.buffer.size() < VALIDATE_CHUNK_SIZE &&
+              fIn->getline(line)) {
+            chunk.buffer += line;
+            chunk.buffer += '\n';
+          }
+          if (chunk.buffer.empty()) {
+            return false;
+          }
+          chunk.data = chunk.buffer.data();
+          chunk.size = chunk.buffer.size();
+        }
+        offset += chunk.size;
+        return true;
+      })
+    .transform("check_lines", [&](Chunk& chunk) {
+        checkChunk(chunk, format, maxReport, repair);
+      })
+    .sink("report", [&](Chunk& chunk) {
+        if (chunk.hasLineNo && hasLineNo && (chunk.firstLineNo < lastLineNo ||
+              (chunk.firstLineNo == lastLineNo && format == FORMAT_DOCS))) {
+          counts[LINE_NO_ORDER]++;
+          numBadLines += !chunk.firstLineBad;
+          chunk.violations.insert(chunk.violations.begin(), chunk.firstLine);
+        }
+        if (chunk.hasLineNo) {
+          hasLineNo = true;
+          lastLineNo = chunk.lastLineNo;
+        }
+
+        for (const Violation& v : chunk.violations) {
+          if (numReported++ >= maxReport) {
+            break;
+          }
+          cout << "line " << numLines + v.line + 1 << ", byte " <<
+            chunk.offset + v.offset << ", column " << v.column << ": " <<
+            KIND_NAMES[v.kind] << " \"" << v.excerpt << "\"\n";
+        }
+        numLines += chunk.numLines;
+        numBadLines += chunk.numBadLines;
+        numDropped += chunk.numDropped;
+        numRepaired += chunk.numRepaired;
+        for (int k = 0; k < NUM_KINDS; k++) {
+          counts[k] += chunk.counts[k];
+        }
+
+        if (repair) {
+          if (chunk.repaired) {
+            fOut->write(chunk.output.data(), chunk.output.size());
+          } else {
+            fOut->write(chunk.data, chunk.size);
+          }
+        }
+      })
+    .progress([&](uint64_t) {
+        if (fileSize != UINT64_MAX) {
+          printPercent(offset, fileSize);
+        }
+      })
+    .run();
+
+  if (mapped != NULL) {
+    munmap(const_cast<char*>(mapped), mappedSize);
+  } else {
+    fIn->close();
+  }
+  fOut.reset();
+
+  printf("\n%lu lines, %lu with violations\n", numLines, numBadLines);
+  for (int k = 0; k < NUM_KINDS; k++) {
+    if (counts[k] > 0) {
+      printf("  %-40s %12lu lines\n", KIND_NAMES[k], counts[k]);
+    }
+  }
+  if (repair) {
+    printf("Repaired file %s: %lu lines dropped, %lu repaired\n",
+        repairFile.c_str(), numDropped, numRepaired);
+  }
+  return numBadLines;
+}
+
+int main(int argc, char** argv) {
+  startTrace(argc, argv);
+  setReadBackend(argc, argv);
+  vector<string> args = getPositionalArgs(argc, argv,
+      {"--format", "--repair", "--max-report", "--trace", "--io"});
+  const vector<string> formats = {"truth", "alg", "docsfile", "wordsfile"};
+  string formatName = getOption(argc, argv, "--format", "truth");
+  auto format = std::find(formats.begin(), formats.end(), formatName);
+  if (args.size() < 1 || format == formats.end()) {
+    cout << "\nUsage: \n" <<
+      "  validate_iob_main <file> [ --format <truth|alg|docsfile|" <<
+      "wordsfile> ] [ --repair <output_file> ]\n" <<
+      "    [ --compress ] [ --max-report <n> ] [ --trace <trace.json> ] " <<
+      "[ --io <auto|uring|threads> ]\n" <<
+      "\nDescription: \n" <<
+      "  Check the lines of an IOB file or generator input on all cores " <<
+      "before a long run, and print the line number and byte offset of " <<
+      "each violation.\n" <<
+      "  Exits with 1 if any line violates the format.\n\n" <<
+      "  <file>\n" <<
+      "    \"-\" to read from stdin. Plain or written with --compress.\n\n" <<
+      "  --format <truth|alg|docsfile|wordsfile>\n" <<
+      "    truth: LINE_NO <TAB> WORD1\\TAG1\\[IOB] <SPACE> ... (default)\n" <<
+      "    alg: LINE_NO <TAB> TRUTH_LINE <TAB> ALG_LINE\n" <<
+      "    docsfile: LINE_NO <TAB> TEXT, LINE_NO increasing\n" <<
+      "    wordsfile: WORD <TAB> 0|1 <TAB> LINE_NO [ <TAB> SCORE ], " <<
+      "LINE_NO non-decreasing\n\n" <<
+      "  --repair <output_file>\n" <<
+      "    Also write the file with violations fixed: empty words and " <<
+      "extra fields removed, missing TAG and\n" <<
+      "    LABEL completed by \"?\" and \"O\", words with spaces split. " <<
+      "Lines that cannot be fixed are dropped,\n" <<
+      "    lines out of order are kept.\n\n" <<
+      "  --compress\n" <<
+      "    Write <output_file> in seekable compressed frames, see " <<
+      "frames.hpp.\n\n" <<
+      "  --max-report <n>\n" <<
+      "    Print at most n violations. Default " << VALIDATE_MAX_REPORT <<
+      ".\n\n" <<
+      TRACE_USAGE <<
+      IO_USAGE;
+    return 1;
+  }
+
+  uint64_t numBadLines = validateIOB(args[0],
+      static_cast<IobFormat>(format - formats.begin()),
+      std::stoull(getOption(argc, argv, "--max-report",
+          std::to_string(VALIDATE_MAX_REPORT))),
+      getOption(argc, argv, "--repair", ""),
+      hasOption(argc, argv, "--compress"));
+  cout << "\nDone!\n\n";
+  return numBadLines > 0 ? 1 : 0;
+}